@@ -0,0 +1,375 @@
+/*
+    loopcast is a small client/server utility to distribute data or simple
+    orders to a high number of clients through a multicast network socket.
+
+    Copyright (C) 2010  Olivier Guerrier <olivier@guerrier.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Per-packet cost of the core buffer functions. Each case is run <repeat>
+ * times and the fastest run is reported, one line per case:
+ *   bench=<name> chunks=<n> dup=<%> packets=<n> ns_per_packet=<f>
+ *   cycles_per_byte=<f> allocs=<n> alloc_bytes=<n>
+ * The flight recorder is on, as in loopsend and looprecv, and the "trace"
+ * case is the cost of one event. Allocations (malloc and mmap) are counted
+ * over a whole run, including buffer_init, and are intercepted with the
+ * linker (--wrap). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "loopcast.h"
+
+long allocs, alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd,
+		  off_t offset);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	alloc_bytes += nmemb * size;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd,
+		  off_t offset)
+{
+	allocs++;
+	alloc_bytes += length;
+	return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+typedef struct result_s {
+	double ns;
+	uint64_t cycles;
+	long allocs, alloc_bytes;
+} result_t;
+
+typedef struct bench_s {
+	options_t options;
+	buffer_t source;
+	message_t *frames;
+	uint32_t *order;
+	uint32_t nchunks;
+	uint32_t packets;
+	FILE *null;
+} bench_t;
+
+uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+double bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench_start(result_t * result)
+{
+	allocs = alloc_bytes = 0;
+	result->ns = bench_ns();
+	result->cycles = bench_cycles();
+}
+
+void bench_stop(result_t * result)
+{
+	result->cycles = bench_cycles() - result->cycles;
+	result->ns = bench_ns() - result->ns;
+	result->allocs = allocs;
+	result->alloc_bytes = alloc_bytes;
+}
+
+void bench_crc32(bench_t * bench, result_t * result)
+{
+	volatile uint32_t crc = 0;
+	uint32_t i;
+
+	bench_start(result);
+	for (i = 0; i < bench->packets; i++) {
+		crc += crc32((uint8_t *) & bench->frames[i % bench->nchunks],
+			     sizeof(message_t));
+	}
+	bench_stop(result);
+}
+
+void bench_trace(bench_t * bench, result_t * result)
+{
+	uint32_t i;
+
+	bench_start(result);
+	for (i = 0; i < bench->packets; i++) {
+		trace(TRACE_RECV, i);
+	}
+	bench_stop(result);
+}
+
+void bench_send(bench_t * bench, result_t * result)
+{
+	message_t message;
+	uint32_t i;
+
+	bench_start(result);
+	for (i = 0; i < bench->packets; i++) {
+		buffer_send(&bench->source, i % bench->nchunks, &message);
+	}
+	bench_stop(result);
+}
+
+void bench_recv(bench_t * bench, result_t * result)
+{
+	buffer_t buffer;
+	message_t *message;
+	uint32_t i, crc;
+	double ns;
+	uint64_t cycles;
+
+	bench_start(result);
+	buffer_init(&bench->options, &buffer, NULL);
+	ns = bench_ns();
+	cycles = bench_cycles();
+	for (i = 0; i < bench->packets; i++) {
+		message = &bench->frames[bench->order[i]];
+		crc = message->crc;
+		buffer_recv(&bench->options, &buffer, message);
+		message->crc = crc;
+	}
+	cycles = bench_cycles() - cycles;
+	ns = bench_ns() - ns;
+	buffer_clean(&buffer);
+	bench_stop(result);
+	result->ns = ns;
+	result->cycles = cycles;
+}
+
+void bench_dump(bench_t * bench, result_t * result)
+{
+	buffer_t buffer;
+	uint32_t i, crc;
+	double ns;
+	uint64_t cycles;
+
+	bench_start(result);
+	buffer_init(&bench->options, &buffer, NULL);
+	for (i = 0; i < bench->nchunks; i++) {
+		crc = bench->frames[i].crc;
+		buffer_recv(&bench->options, &buffer, &bench->frames[i]);
+		bench->frames[i].crc = crc;
+	}
+	ns = bench_ns();
+	cycles = bench_cycles();
+	buffer_dump(&buffer, bench->null);
+	fflush(bench->null);
+	cycles = bench_cycles() - cycles;
+	ns = bench_ns() - ns;
+	buffer_clean(&buffer);
+	bench_stop(result);
+	result->ns = ns;
+	result->cycles = cycles;
+}
+
+/* unique chunks in order, with <dup>% of the packets being repeats of
+ * chunks already received */
+void bench_order(bench_t * bench, int dup, uint64_t * seed)
+{
+	uint32_t i, next = 0;
+
+	bench->packets = (uint64_t)bench->nchunks * 100 / (100 - dup);
+	for (i = 0; i < bench->packets; i++) {
+		*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		if (next && (*seed >> 33) % (bench->packets - i) >=
+		    bench->nchunks - next) {
+			bench->order[i] = (*seed >> 17) % next;
+		} else {
+			bench->order[i] = next++;
+		}
+	}
+}
+
+void bench_report(char *name, bench_t * bench, int dup, uint32_t packets,
+		  void (*fn) (bench_t *, result_t *), int repeat)
+{
+	result_t result, best;
+	int r;
+
+	memset(&best, 0, sizeof(best));
+	for (r = 0; r < repeat; r++) {
+		fn(bench, &result);
+		if (!r || result.ns < best.ns) {
+			best = result;
+		}
+	}
+	printf
+	    ("bench=%s chunks=%u dup=%d packets=%u ns_per_packet=%.1f cycles_per_byte=%.3f allocs=%ld alloc_bytes=%ld\n",
+	     name, bench->nchunks, dup, packets, best.ns / packets,
+	     (double)best.cycles / ((double)packets * sizeof(message_t)),
+	     best.allocs, best.alloc_bytes);
+	fflush(stdout);
+}
+
+void bench_usage(char *me)
+{
+	do_printf("Usage:\n\t%s [options]\n", me);
+	do_printf("\t  -h : this help screen\n");
+	do_printf
+	    ("\t  -n <chunks>[,<chunks>...] : image sizes in %dKB chunks (default 256,4096,16384)\n",
+	     CHUNKSIZE / 1024);
+	do_printf
+	    ("\t  -d <percent>[,<percent>...] : duplicate ratios for buffer_recv (default 0,50,90)\n");
+	do_printf("\t  -r <repeat> : runs per case, the fastest is reported (default 5)\n");
+	exit(0);
+}
+
+int parse_list(char *arg, int *list, int max)
+{
+	int n = 0;
+
+	while (arg && n < max) {
+		list[n++] = atoi(arg);
+		arg = strchr(arg, ',');
+		if (arg) {
+			arg++;
+		}
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	char *noargs[] = { argv[0], NULL };
+	int sizes[16] = { 256, 4096, 16384 }, nsizes = 3;
+	int dups[16] = { 0, 50, 90 }, ndups = 3;
+	int optc, s, d, repeat = 5;
+	uint64_t seed = 1;
+	bench_t bench;
+	FILE *image;
+	uint32_t i;
+
+	while ((optc = getopt(argc, argv, "d:hn:r:")) != EOF) {
+		switch (optc) {
+		case 'd':
+			ndups = parse_list(optarg, dups, 16);
+			break;
+		case 'n':
+			nsizes = parse_list(optarg, sizes, 16);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+	for (s = 0; s < nsizes; s++) {
+		if (sizes[s] < 1 || sizes[s] > 65535) {
+			bench_usage(argv[0]);
+		}
+	}
+	for (d = 0; d < ndups; d++) {
+		if (dups[d] < 0 || dups[d] > 99) {
+			bench_usage(argv[0]);
+		}
+	}
+	if (repeat < 1) {
+		bench_usage(argv[0]);
+	}
+
+	/* the flight recorder is always on in loopsend and looprecv */
+	trace_thread("bench");
+	memset(&bench, 0, sizeof(bench));
+	bench.null = fopen("/dev/null", "w");
+	if (!bench.null) {
+		ERROR(("loopbench: Unable to open /dev/null\n"));
+	}
+	for (s = 0; s < nsizes; s++) {
+		optind = 1;
+		options_init(&bench.options, SENDER, 1, noargs);
+		bench.nchunks = bench.options.maxchunks = sizes[s];
+		image = tmpfile();
+		if (!image) {
+			ERROR(("loopbench: Unable to create image file\n"));
+		}
+		for (i = 0; i < bench.nchunks * CHUNKSIZE / sizeof(seed); i++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			fwrite(&seed, sizeof(seed), 1, image);
+		}
+		rewind(image);
+		buffer_init(&bench.options, &bench.source, image);
+		fclose(image);
+		bench.frames = malloc(bench.nchunks * sizeof(message_t));
+		bench.order = malloc(bench.nchunks * 100 * sizeof(uint32_t));
+		if (!bench.frames || !bench.order) {
+			ERROR(("loopbench: Not enough memory\n"));
+		}
+		for (i = 0; i < bench.nchunks; i++) {
+			buffer_send(&bench.source, i, &bench.frames[i]);
+		}
+		bench.options.sender = RECEIVER;
+
+		bench.packets = bench.nchunks;
+		bench_report("crc32", &bench, 0, bench.packets, bench_crc32,
+			     repeat);
+		bench_report("trace", &bench, 0, bench.packets, bench_trace,
+			     repeat);
+		bench_report("buffer_send", &bench, 0, bench.packets,
+			     bench_send, repeat);
+		for (d = 0; d < ndups; d++) {
+			bench_order(&bench, dups[d], &seed);
+			bench_report("buffer_recv", &bench, dups[d],
+				     bench.packets, bench_recv, repeat);
+		}
+		bench.packets = bench.nchunks;
+		bench_report("buffer_dump", &bench, 0, bench.packets,
+			     bench_dump, repeat);
+
+		buffer_clean(&bench.source);
+		free(bench.frames);
+		free(bench.order);
+	}
+	fclose(bench.null);
+	return 0;
+}
@@ -20,16 +20,28 @@
 
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <linux/sockios.h>
+#ifdef __KLIBC__
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
 
 #include "loopcast.h"
 
@@ -64,6 +76,103 @@ int do_printf(const char *fmt, ...)
 	return ret;
 }
 
+/* Flight recorder: always on, trace() is a store in the calling thread's
+ * ring. The rings are dumped at exit with -T, or on SIGQUIT */
+TRACE_TLS tracering_t *trace_ring;
+tracering_t *trace_rings[MAXTRACERINGS];
+int trace_nrings;
+uint64_t trace_clock0, trace_ns0;
+char *trace_file;
+
+uint64_t trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* give the calling thread its own ring */
+int trace_thread(const char *name)
+{
+	tracering_t *ring;
+	int i;
+
+	ring = malloc(sizeof(tracering_t));
+	if (!ring) {
+		return 0;
+	}
+	memset(ring, 0, sizeof(tracering_t));
+	strncpy(ring->name, name, sizeof(ring->name) - 1);
+	i = __sync_fetch_and_add(&trace_nrings, 1);
+	if (i >= MAXTRACERINGS) {
+		free(ring);
+		return 0;
+	}
+	trace_rings[i] = ring;
+	trace_ring = ring;
+	return 1;
+}
+
+void trace_atexit(void)
+{
+	trace_dump(trace_file);
+}
+
+int trace_init(options_t * options)
+{
+	trace_ns0 = trace_ns();
+	trace_clock0 = trace_clock();
+	trace_thread("main");
+	if (options->tracefile) {
+		trace_file = options->tracefile;
+		atexit(trace_atexit);
+	}
+	return 1;
+}
+
+/* <filename> NULL is the -T file, or /tmp/loopcast.<pid>.trace. The other
+ * threads keep on recording, their most recent events may be torn */
+int trace_dump(const char *filename)
+{
+	char name[64];
+	tracefile_t header;
+	FILE *file;
+	int i;
+
+	if (!filename) {
+		filename = trace_file;
+	}
+	if (!filename) {
+		snprintf(name, sizeof(name), "/tmp/loopcast.%d.trace",
+			 (int)getpid());
+		filename = name;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.nrings = trace_nrings < MAXTRACERINGS ?
+	    trace_nrings : MAXTRACERINGS;
+#if defined(__x86_64__) || defined(__i386__)
+	header.tsc = 1;
+#endif
+	header.clock0 = trace_clock0;
+	header.ns0 = trace_ns0;
+	header.clock1 = trace_clock();
+	header.ns1 = trace_ns();
+	file = fopen(filename, "w");
+	if (!file) {
+		do_printf("Unable to write the trace to '%s'\n", filename);
+		return 0;
+	}
+	fwrite(&header, sizeof(header), 1, file);
+	for (i = 0; i < header.nrings; i++) {
+		fwrite(trace_rings[i], sizeof(tracering_t), 1, file);
+	}
+	fclose(file);
+	do_printf("Trace written to '%s'\n", filename);
+	return 1;
+}
+
 void do_statuscmd(options_t * options, int percent)
 {
 	char temp[STATUSCMD_LENGTH + 10];
@@ -75,12 +184,171 @@ void do_statuscmd(options_t * options, int percent)
 	}
 }
 
+/* The status command is run by a helper process, fed with percent values
+ * through a non-blocking pipe: fork+shell never happens on the receive
+ * path, and a slow command only delays the following reports. */
+int progress_init(options_t * options, network_t * network)
+{
+	int fds[2], percent;
+
+	if (!strlen(options->statuscmd)) {
+		return 0;
+	}
+	if (pipe(fds) < 0) {
+		ERROR(("progress_init: Unable to create pipe"));
+	}
+	network->progresspid = fork();
+	if (network->progresspid < 0) {
+		ERROR(("progress_init: Unable to fork status helper"));
+	}
+	if (!network->progresspid) {
+		/* stdout carries the received data */
+		dup2(2, 1);
+		signal(SIGPIPE, SIG_DFL);
+		close(fds[1]);
+		while (read(fds[0], &percent, sizeof(percent)) ==
+		       sizeof(percent)) {
+			do_statuscmd(options, percent);
+		}
+		/* no atexit hooks, the trace dump is the parent's */
+		_exit(0);
+	}
+	close(fds[0]);
+	/* a dead helper must not take us with it, see progress_report */
+	signal(SIGPIPE, SIG_IGN);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	network->progressfd = fds[1];
+	network->percent = -1;
+	return 1;
+}
+
+void progress_report(network_t * network, int percent)
+{
+	if (network->progresspid > 0) {
+		/* the pipe is never full in practice, if it is the report is
+		 * dropped rather than blocking. If the helper is gone, so are
+		 * the following ones */
+		if (write(network->progressfd, &percent, sizeof(percent)) < 0) {
+			DEBUGP(("progress_report: %d%% dropped\n", percent));
+			if (errno == EPIPE) {
+				close(network->progressfd);
+				waitpid(network->progresspid, NULL, WNOHANG);
+				network->progresspid = 0;
+			}
+		}
+		network->percent = percent;
+	}
+}
+
+/* called for each new chunk, reports every <step>%, and 100% */
+void progress_update(options_t * options, network_t * network,
+		     buffer_t * buffer)
+{
+	int percent, next;
+
+	/* the image size is not known yet, or never with -R */
+	if (network->progresspid <= 0 || !options->statusstep
+	    || !buffer->nchunks) {
+		return;
+	}
+	percent = (uint64_t)buffer->received * 100 / buffer->nchunks;
+	next = (network->percent / options->statusstep + 1) *
+	    options->statusstep;
+	while (next <= percent && next < 100) {
+		progress_report(network, next);
+		next += options->statusstep;
+	}
+	if (percent == 100 && network->percent != 100) {
+		progress_report(network, 100);
+	}
+}
+
+/* let the helper run the pending reports before we exit */
+int progress_clean(network_t * network)
+{
+	if (network->progresspid > 0) {
+		close(network->progressfd);
+		waitpid(network->progresspid, NULL, 0);
+		network->progresspid = 0;
+	}
+	return 1;
+}
+
 void usage(options_t * options, char *me)
 {
 	do_printf("Usage:\n\t%s [options]\n", me);
 	do_printf("\t  -h : this help screen\n");
-	do_printf("\t  -i <ethernet interface name>\n");
+	if (options->sender) {
+		do_printf
+		    ("\t  -a <cpu>[,<cpu>...] : pin the transmit workers to these cpus, one each in\n"
+		     "\t\tturn (one worker per interface and layer).\n");
+		do_printf
+		    ("\t  -b : busy-wait pacing, the workers sleep until %dus before each packet is\n"
+		     "\t\tdue, then spin on the clock. The image is locked in memory.\n",
+		     BUSYWAIT / 1000);
+	} else {
+		do_printf
+		    ("\t  -A : peer repair, ask the other receivers of the segment for the chunks missed\n"
+		     "\t\tin the current loop, and answer theirs, on <port number+3>.\n");
+		do_printf
+		    ("\t  -b <usec> : busy poll the data sockets for up to <usec> (SO_BUSY_POLL), raising\n"
+		     "\t\tit above net.core.busy_read needs CAP_NET_ADMIN.\n");
+	}
+	if (options->sender) {
+		do_printf
+		    ("\t  -c : command mode, only send the return value (-r) to the clients, repeated\n"
+		     "\t\twith exponential backoff until -N clients acknowledged it or <maxwait>\n"
+		     "\t\tseconds, then print a summary of the acknowledgements. stdin is not read.\n");
+		do_printf
+		    ("\t  -C <carousel file> : compile the input into a carousel file (pre-framed chunks,\n"
+		     "\t\tchecksums and digest) and exit, without sending anything.\n");
+		do_printf
+		    ("\t  -D : daemon, keep the image and idle until a client sends a keepalive, send\n"
+		     "\t\tuntil all clients are done or keepalives expire, then idle again (implies -k).\n");
+		do_printf
+		    ("\t  -F <carousel file> : send a compiled carousel file instead of stdin, startup\n"
+		     "\t\tdoes not depend on the image size. The return value is the compiled one.\n");
+	}
+	if (options->sender) {
+		do_printf
+		    ("\t  -H <thp|huge> : read the input in an arena backed by transparent or explicit\n"
+		     "\t\thugepages, instead of mapping it when it is a regular file.\n");
+	}
+	if (options->sender) {
+		do_printf
+		    ("\t  -i <interface>[:<bwlimit>][,<interface>[:<bwlimit>]...] : send through each of\n"
+		     "\t\tthese interfaces, with an optional per-interface bandwidth limit in KiB/s\n");
+	} else {
+		do_printf("\t  -i <ethernet interface name>\n");
+		do_printf
+		    ("\t  -j <journal file> : resumable receive, keep the chunks and the list of those\n"
+		     "\t\treceived in this file. Restarted with the same file, only the missing\n"
+		     "\t\tchunks are waited for. It is removed once the image is written.\n");
+	}
 	do_printf("\t  -d <multicast ip address>\n");
+	if (options->sender) {
+		do_printf
+		    ("\t  -K <key file> : sign commands (-c) with this shared secret.\n");
+	} else {
+		do_printf
+		    ("\t  -K <key file> : only obey commands signed with this shared secret.\n");
+		do_printf
+		    ("\t  -l <interface>[:<bwlimit>] : relay, re-multicast chunks through <interface> as soon\n"
+		     "\t\tas they are validated, then keep looping the image there once it is written\n"
+		     "\t\t(and stdout closed) while clients send keepalives (-k), for <maxwait> (-m)\n"
+		     "\t\tseconds, or forever.\n");
+	}
+	if (options->sender) {
+		do_printf
+		    ("\t  -L <layers> : layered multicast, the image is spread over <layers> groups from\n"
+		     "\t\tthe -d address up, the first one at the -w rate and each next one doubling\n"
+		     "\t\tthe cumulative rate. Receivers join as many as their path sustains.\n");
+	} else {
+		do_printf
+		    ("\t  -L <layers> : layered multicast (as many as the sender), join the next layer\n"
+		     "\t\twhile the loss stays under %d%%, leave the last one above.\n",
+		     LAYERLOSS);
+	}
 	do_printf
 	    ("\t  -p <port number> : port number used to transmit data. If keepalive message are enabled,\n"
 	     "\t\t<port number+1> is also used.\n");
@@ -97,6 +365,10 @@ void usage(options_t * options, char *me)
 	} else {
 		do_printf
 		    ("\t  -k : activate keepalive messages, send this if we need more loops from server.\n");
+		do_printf
+		    ("\t  -f : scalable keepalives for large fleets (implies -k): randomized, only a sample\n"
+		     "\t\tof the receivers reports, the others stay quiet when a receiver as far behind\n"
+		     "\t\twas just heard on <port number+1>.\n");
 		do_printf
 		    ("\t  -m <maxwait> : if 'keepalive' messages are activated (using -k), this is the time\n"
 		     "\t\tto wait before sending a new keepalive message to the server.\n");
@@ -113,24 +385,60 @@ void usage(options_t * options, char *me)
 	     CHUNKSIZE / 1024, options->sender ? "send" : "receive");
 	if (options->sender) {
 		do_printf("\t  -o <filename> : output to given file\n");
+		do_printf
+		    ("\t  -P <index>/<count> : cooperative senders, all serving the same image on the same\n"
+		     "\t\tgroup, each one sends its share of the chunks (index from 0 to count-1) and\n"
+		     "\t\ttakes over the share of a peer that stops announcing itself.\n");
+		do_printf
+		    ("\t  -q <priority> : run the transmit workers SCHED_FIFO at this priority (1-99),\n"
+		     "\t\tneeds CAP_SYS_NICE.\n");
 		do_printf
 		    ("\t  -r <return value> : this value will be returned by the receiver as exit code\n");
+		do_printf
+		    ("\t  -S : streaming, send chunks as they are read from stdin, with a provisional\n"
+		     "\t\timage size, and start looping once the whole input is read (no -z).\n");
 	} else {
 		do_printf
 		    ("\t  -r <value> : exit as soon as the exit code is known, no data is send to the exit file descriptor\n"
 		     "\t\tIf keepalives are activated, the <value> is also send to the server.\n");
 	}
+	do_printf
+	    ("\t  -T <trace file> : dump the flight recorder (packets, pacing, keepalives) to this\n"
+	     "\t\tfile at exit, see looptrace. SIGQUIT dumps it at any time, by default to\n"
+	     "\t\t/tmp/loopcast.<pid>.trace.\n");
+	if (options->sender) {
+		do_printf
+		    ("\t  -u <percent> : once <percent>%% of the clients are done, stop the multicast\n"
+		     "\t\tloops and send the missing chunks to the others in unicast, on their\n"
+		     "\t\trequest to <port number+2> (implies -k, clients must use -k).\n");
+	}
 	do_printf("\t  -v : be verbose\n");
 	if (options->sender) {
 		do_printf
-		    ("\t  -w <bwlimit> in KiB/s : if defined, the data will not be send faster than the\n\t\tdefined speed (default unlimited).\n");
+		    ("\t  -V : publish the image digest every %d chunks, for receivers checking it (-V)\n"
+		     "\t\tor resuming from a journal (-j). Receivers older than the digest stop on it.\n",
+		     SLABCHUNKS);
+	} else {
+		do_printf
+		    ("\t  -V : only write the image once it matches the sender's digest, exit with an error\n"
+		     "\t\ton mismatch. Without it, a mismatch is only reported.\n");
+		do_printf
+		    ("\t  -W <capture file> : record the datagrams received, with their arrival time,\n"
+		     "\t\tto be fed again through the receive path by loopreplay.\n");
+	}
+	if (options->sender) {
+		do_printf
+		    ("\t  -w <bwlimit> in KiB/s : if defined, the data will not be send faster than the\n\t\tdefined speed on each interface (default unlimited).\n");
+		do_printf
+		    ("\t  -z : do not send chunks made of a single repeated byte (zeroes...), send a\n"
+		     "\t\trun-length map instead. Receivers write zero runs as holes when possible.\n");
 	}
 	do_printf
 	    ("\t  -x </path/to/some/app> : if defined, this app will be called at each <step>%% value.\n"
 	     "\t\tIf <step> is not defined, the app will only be called at 1st data reception.\n"
 	     "\t  -s <step value> : the <app> will be called each %%<step> of transfer completion\n"
 	     "\t\t0%% and 100%% will always be treated as special values, and always be called\n"
-	     "\t\t(this <step> feature is still a work in progress, not implemented yet)\n");
+	     "\t\tThe app is run in the background, reception is never blocked by it.\n");
 	exit(0);
 }
 
@@ -147,11 +455,107 @@ int keepalives_init(options_t * options)
 	return 1;
 }
 
+/* sender's interfaces: <name>[:<bwlimit>][,<name>[:<bwlimit>]...] */
+int interfaces_init(options_t * options, char *arg)
+{
+	struct egress_s *egress;
+	char *next, *colon;
+	int len;
+
+	options->ninterfaces = 0;
+	while (arg && *arg) {
+		if (options->ninterfaces == MAXINTERFACES) {
+			do_printf("Too many interfaces, only using %d\n",
+				  MAXINTERFACES);
+			break;
+		}
+		egress = &options->egress[options->ninterfaces];
+		next = strchr(arg, ',');
+		colon = strchr(arg, ':');
+		if (colon && (!next || colon < next)) {
+			egress->bwlimit = atoi(colon + 1);
+			len = colon - arg;
+		} else {
+			egress->bwlimit = 0;
+			len = next ? next - arg : strlen(arg);
+		}
+		if (len >= IFNAMSIZ) {
+			len = IFNAMSIZ - 1;
+		}
+		memcpy(egress->interface, arg, len);
+		egress->interface[len] = 0;
+		options->ninterfaces++;
+		arg = next ? next + 1 : NULL;
+	}
+	if (!options->ninterfaces) {
+		options->ninterfaces = 1;
+	}
+	strcpy(options->interface, options->egress[0].interface);
+	return options->ninterfaces;
+}
+
+/* sender's cpus: <cpu>[,<cpu>...], worker n runs on the n % count one */
+int cpus_init(options_t * options, char *arg)
+{
+	options->ncpus = 0;
+	while (arg && *arg) {
+		if (options->ncpus == MAXCPUS) {
+			do_printf("Too many cpus, only using %d\n", MAXCPUS);
+			break;
+		}
+		options->cpus[options->ncpus++] = atoi(arg);
+		arg = strchr(arg, ',');
+		if (arg) {
+			arg++;
+		}
+	}
+	return options->ncpus;
+}
+
+/* shared secret for signed commands, longer keys are hashed (RFC 2104) */
+int keyfile_init(options_t * options, char *filename)
+{
+	uint8_t key[4 * KEYSIZE + 1];
+	FILE *file;
+	int length;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		ERROR(("Unable to read key file '%s'\n", filename));
+	}
+	length = fread(key, 1, sizeof(key), file);
+	fclose(file);
+	if (length <= 0) {
+		ERROR(("Key file '%s' is empty\n", filename));
+	}
+	if (length > 4 * KEYSIZE) {
+		ERROR(("Key file '%s' is longer than %d bytes\n", filename,
+		       4 * KEYSIZE));
+	}
+	memset(options->key, 0, KEYSIZE);
+	if (length > KEYSIZE) {
+		sha256_t ctx;
+
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, length);
+		sha256_final(&ctx, options->key);
+		length = DIGESTSIZE;
+	} else {
+		memcpy(options->key, key, length);
+	}
+	options->keylength = length;
+	memset(key, 0, sizeof(key));
+	if (options->verbose) {
+		do_printf("key read from '%s'\n", filename);
+	}
+	return 1;
+}
+
 int options_init(options_t * options, int sender, int argc, char **argv)
 {
 	int optc, dummy;
-	char *opt_send = "d:hi:km:n:N:o:p:r:vw:";
-	char *opt_recv = "d:hi:km:n:N:p:s:r:Rvx:";
+	char *opt_send = "a:bcC:d:DF:hH:i:kK:L:m:n:N:o:P:p:q:r:ST:u:vVw:z";
+	char *opt_recv = "Ab:d:fhi:j:kK:l:L:m:n:N:p:s:r:RT:vVW:x:";
 	char *opt_mode;
 
 	DEBUGP(("options_init: Enter\n"));
@@ -164,8 +568,9 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 #endif
 	options->sender = sender;
 	options->ip_port = IP_PORT;
-	options->maxwait_itimer.it_value.tv_sec = MAXWAIT;
 	strcpy(options->interface, "eth0");
+	strcpy(options->egress[0].interface, "eth0");
+	options->ninterfaces = 1;
 	if (options->sender) {
 		opt_mode = opt_send;
 	} else {
@@ -175,6 +580,47 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 
 	while ((optc = getopt(argc, argv, opt_mode)) != EOF) {
 		switch (optc) {
+		case 'a':
+			cpus_init(options, optarg);
+			if (options->verbose) {
+				do_printf("workers pinned to cpus %s\n", optarg);
+			}
+			break;
+		case 'A':
+			options->peerrepair = 1;
+			if (options->verbose) {
+				do_printf("peer repair set\n");
+			}
+			break;
+		case 'b':
+			if (options->sender) {
+				options->busywait = 1;
+				if (options->verbose) {
+					do_printf("busy-wait pacing set\n");
+				}
+			} else {
+				options->busypoll = atoi(optarg);
+				if (options->verbose) {
+					do_printf("busy poll set to %dus\n",
+						  options->busypoll);
+				}
+			}
+			break;
+		case 'c':
+			options->command = 1;
+			keepalives_init(options);
+			if (options->verbose) {
+				do_printf("command mode set\n");
+			}
+			break;
+		case 'C':
+			options->compile = strdup(optarg);
+			if (!options->compile) {
+				do_printf
+				    ("unable to allocate options->compile\n");
+				exit(255);
+			}
+			break;
 		case 'd':
 			options->ip_addr = inet_addr(optarg);
 			if (!options->ip_addr) {
@@ -183,25 +629,106 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				options->ip_addr = inet_addr(IP_ADDR);
 			}
 			break;
+		case 'D':
+			options->daemon = 1;
+			keepalives_init(options);
+			if (options->verbose) {
+				do_printf("daemon mode set\n");
+			}
+			break;
+		case 'F':
+			options->carousel = strdup(optarg);
+			if (!options->carousel) {
+				do_printf
+				    ("unable to allocate options->carousel\n");
+				exit(255);
+			}
+			if (options->verbose) {
+				do_printf("carousel file set to '%s'\n",
+					  optarg);
+			}
+			break;
+		case 'f':
+			options->feedback = 1;
+			keepalives_init(options);
+			if (options->verbose) {
+				do_printf("scalable feedback set\n");
+			}
+			break;
 		case 'h':
 			usage(options, argv[0]);
 			break;
+		case 'H':
+			if (!strcmp(optarg, "thp")) {
+				options->hugepages = HUGEPAGES_TRANSPARENT;
+			} else if (!strcmp(optarg, "huge")) {
+				options->hugepages = HUGEPAGES_EXPLICIT;
+			} else {
+				do_printf
+				    ("'%s' is not a valid hugepages mode (thp or huge)\n",
+				     optarg);
+			}
+			if (options->hugepages && options->verbose) {
+				do_printf("hugepages set to '%s'\n", optarg);
+			}
+			break;
 		case 'i':
-			strncpy(options->interface, optarg,
-				sizeof(options->interface) - 1);
+			if (options->sender) {
+				interfaces_init(options, optarg);
+			} else {
+				strncpy(options->interface, optarg,
+					sizeof(options->interface) - 1);
+			}
 			if (options->verbose) {
 				do_printf("interface set to '%s'\n", optarg);
 			}
 			break;
+		case 'j':
+			options->journal = strdup(optarg);
+			if (!options->journal) {
+				do_printf
+				    ("unable to allocate options->journal\n");
+				exit(255);
+			}
+			if (options->verbose) {
+				do_printf("journal set to '%s'\n", optarg);
+			}
+			break;
 		case 'k':
 			keepalives_init(options);
 			break;
+		case 'K':
+			keyfile_init(options, optarg);
+			break;
+		case 'l':
+			options->relay = strdup(optarg);
+			if (!options->relay) {
+				do_printf
+				    ("unable to allocate options->relay\n");
+				exit(255);
+			}
+			if (options->verbose) {
+				do_printf("relay through '%s'\n", optarg);
+			}
+			break;
+		case 'L':
+			dummy = atoi(optarg);
+			if ((dummy > 0) && (dummy <= MAXLAYERS)) {
+				options->layers = dummy;
+				if (options->verbose) {
+					do_printf("layers set to '%s'\n",
+						  optarg);
+				}
+			} else {
+				do_printf
+				    ("'%s' is not a valid number of layers (0<n<=%d)\n",
+				     optarg, MAXLAYERS);
+			}
+			break;
 		case 'm':
 			dummy = atoi(optarg);
 			if (dummy > 0) {
-				options->maxwait =
-				    options->maxwait_itimer.it_value.tv_sec =
-				    dummy;
+				options->maxwait = dummy;
 				if (options->verbose) {
 					do_printf
 					    ("max wait duration set to '%s' seconds\n",
@@ -265,6 +792,21 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				do_printf("output set to '%s'\n", optarg);
 			}
 			break;
+		case 'P':
+			if (sscanf(optarg, "%d/%d", &options->peerindex,
+				   &options->npeers) != 2
+			    || options->npeers < 1
+			    || options->npeers > MAXPEERS
+			    || options->peerindex < 0
+			    || options->peerindex >= options->npeers) {
+				do_printf
+				    ("'%s' is not a valid peer (<index>/<count>, count <= %d)\n",
+				     optarg, MAXPEERS);
+				options->peerindex = options->npeers = 0;
+			} else if (options->verbose) {
+				do_printf("peer set to '%s'\n", optarg);
+			}
+			break;
 		case 'p':
 			dummy = atoi(optarg);
 			if ((dummy > 0) && (dummy < 65535)) {
@@ -280,6 +822,21 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				     optarg);
 			}
 			break;
+		case 'q':
+			dummy = atoi(optarg);
+			if (dummy > 0 && dummy < 100) {
+				options->rtprio = dummy;
+				if (options->verbose) {
+					do_printf
+					    ("SCHED_FIFO priority set to '%s'\n",
+					     optarg);
+				}
+			} else {
+				do_printf
+				    ("'%s' is not a valid SCHED_FIFO priority\n",
+				     optarg);
+			}
+			break;
 		case 'r':
 			options->returnvalue = atoi(optarg);
 			keepalives_init(options);
@@ -293,6 +850,12 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				do_printf("exit on value set to true\n");
 			}
 			break;
+		case 'S':
+			options->stream = 1;
+			if (options->verbose) {
+				do_printf("streaming mode set\n");
+			}
+			break;
 		case 's':
 			dummy = atoi(optarg);
 			if ((dummy > 0) && (dummy <= 100)) {
@@ -308,9 +871,49 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				     optarg);
 			}
 			break;
+		case 'T':
+			options->tracefile = strdup(optarg);
+			if (!options->tracefile) {
+				do_printf
+				    ("unable to allocate options->tracefile\n");
+				exit(255);
+			}
+			if (options->verbose) {
+				do_printf("trace file set to '%s'\n", optarg);
+			}
+			break;
+		case 'u':
+			dummy = atoi(optarg);
+			if ((dummy > 0) && (dummy <= 100)) {
+				options->repair = dummy;
+				keepalives_init(options);
+				if (options->verbose) {
+					do_printf
+					    ("unicast repair threshold set to '%s'%%\n",
+					     optarg);
+				}
+			} else {
+				do_printf
+				    ("'%s' is not a valid repair threshold (0<n<=100)\n",
+				     optarg);
+			}
+			break;
 		case 'v':
 			options->verbose = 1;
 			break;
+		case 'V':
+			if (options->sender) {
+				options->senddigest = 1;
+				if (options->verbose) {
+					do_printf("image digest is published\n");
+				}
+				break;
+			}
+			options->verifydigest = 1;
+			if (options->verbose) {
+				do_printf("image digest is enforced\n");
+			}
+			break;
 		case 'w':
 			dummy = atoi(optarg);
 			if (dummy > 0) {
@@ -325,35 +928,33 @@ int options_init(options_t * options, int sender, int argc, char **argv)
 				     optarg);
 			}
 			break;
+		case 'W':
+			options->capture = strdup(optarg);
+			if (!options->capture) {
+				do_printf
+				    ("unable to allocate options->capture\n");
+				exit(255);
+			}
+			if (options->verbose) {
+				do_printf("capture file set to '%s'\n", optarg);
+			}
+			break;
 		case 'x':
 			strncpy(options->statuscmd, optarg, STATUSCMD_LENGTH);
 			break;
+		case 'z':
+			options->sparse = 1;
+			if (options->verbose) {
+				do_printf("sparse chunk elision set\n");
+			}
+			break;
 		}
 	}
-
-	if (options->bwlimit) {
-		unsigned long sleep;
-		sleep = (10240 * options->bwlimit) / sizeof(message_t);
-		sleep = 10000000L / sleep;
-		options->bwlimit_itimer.it_value.tv_sec = sleep / 1000000L;
-		options->bwlimit_itimer.it_value.tv_usec =
-		    sleep -
-		    (options->bwlimit_itimer.it_value.tv_sec * 1000000L);;
-		if (options->verbose) {
-			do_printf
-			    ("bwlimit sleep value set to %ds, %dµs\n",
-			     options->bwlimit_itimer.it_value.tv_sec,
-			     options->bwlimit_itimer.it_value.tv_usec);
-		}
-		if ((options->bwlimit_itimer.it_value.tv_sec +
-		     options->bwlimit_itimer.it_value.tv_usec) == 0) {
-			options->bwlimit = 0;
-			if (options->verbose) {
-				do_printf
-				    ("Wait duration is 0µs, bwlimit deactivated\n");
-			}
-		}
+	/* the sparse map is only known once the whole input is read */
+	if (options->stream && options->sparse) {
+		ERROR(("Streaming (-S) and sparse chunk elision (-z) can't be used together\n"));
 	}
+
 	DEBUGP(("options_init: Exit\n"));
 	return 1;
 }
@@ -414,12 +1015,362 @@ inline uint32_t crc32(uint8_t * data, int len)
 	return ~result;
 }
 
-int network_init(options_t * options, network_t * network)
+// sha256 from FIPS 180-4, used for the whole image digest
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(sha256_t * ctx, const uint8_t * block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t) block[i * 4] << 24 | block[i * 4 + 1] << 16 |
+		    block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for (; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		    (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+		     (w[i - 15] >> 3)) +
+		    (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+		     (w[i - 2] >> 10));
+	}
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+		    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+		    ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+void sha256_init(sha256_t * ctx)
+{
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, h, sizeof(h));
+	ctx->count = 0;
+}
+
+void sha256_update(sha256_t * ctx, const uint8_t * data, size_t len)
+{
+	size_t used = ctx->count % 64, n;
+
+	ctx->count += len;
+	if (used) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->block + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		sha256_block(ctx, ctx->block);
+	}
+	for (; len >= 64; data += 64, len -= 64) {
+		sha256_block(ctx, data);
+	}
+	memcpy(ctx->block, data, len);
+}
+
+void sha256_final(sha256_t * ctx, uint8_t * digest)
+{
+	uint64_t bits = ctx->count * 8;
+	uint8_t pad[72];
+	size_t n;
+	int i;
+
+	n = 64 - (ctx->count + 8) % 64;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) {
+		pad[n + i] = bits >> (56 - i * 8);
+	}
+	sha256_update(ctx, pad, n + 8);
+	for (i = 0; i < 32; i++) {
+		digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+	}
+}
+
+/* RFC 2104, keys are at most KEYSIZE bytes (see options_init) */
+void hmac_sha256(const uint8_t * key, int keylength, const uint8_t * data,
+		 size_t length, uint8_t * mac)
+{
+	uint8_t pad[KEYSIZE], inner[DIGESTSIZE];
+	sha256_t ctx;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, key, keylength);
+	for (i = 0; i < KEYSIZE; i++) {
+		pad[i] ^= 0x36;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, KEYSIZE);
+	sha256_update(&ctx, data, length);
+	sha256_final(&ctx, inner);
+	for (i = 0; i < KEYSIZE; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, KEYSIZE);
+	sha256_update(&ctx, inner, DIGESTSIZE);
+	sha256_final(&ctx, mac);
+}
+
+/* data socket sending through the interface <i> of the sender */
+int udp_egress(options_t * options, network_t * network, int i)
 {
 	unsigned char ttl = 3;
 	unsigned char one = 1;
+	netsock_t *sock;
 
-	memset(network, 0, sizeof(network_t));
+	if (i) {
+		sock = malloc(sizeof(netsock_t));
+		if (!sock) {
+			ERROR(("network_init: Not enough memory"));
+		}
+		memset(sock, 0, sizeof(netsock_t));
+		sock->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+		if (sock->sock < 0) {
+			ERROR(("network_init: Error creating data socket"));
+		}
+		network->egress[i] = sock;
+		network->negress++;
+	}
+	sock = network->egress[i];
+
+	strncpy(sock->interface.ifr_name, options->egress[i].interface,
+		IFNAMSIZ - 1);
+	if (ioctl(sock->sock, SIOCGIFADDR, &sock->interface) == 0) {
+		sock->iaddr =
+		    ((struct sockaddr_in *)&sock->interface.ifr_addr)->sin_addr;
+	} else if (options->ninterfaces > 1) {
+		ERROR(("network_init: Unable to get address of interface %s\n", options->egress[i].interface));
+	} else if (options->verbose) {
+		do_printf
+		    ("Unable to get address of interface %s, using default route\n",
+		     options->egress[i].interface);
+	}
+	setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_IF, &sock->iaddr,
+		   sizeof(struct in_addr));
+
+	setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_TTL,
+		   &ttl, sizeof(unsigned char));
+
+	setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+		   &one, sizeof(unsigned char));
+
+	sock->saddr.sin_family = PF_INET;
+	sock->saddr.sin_addr.s_addr = options->ip_addr;
+	sock->saddr.sin_port = htons(options->ip_port);
+	return 1;
+}
+
+/* receiver: peer repair sockets, requests are heard on <port+3> and sent
+ * with a TTL of 1, without loopback, through a second socket */
+int udp_peers_init(options_t * options, network_t * network)
+{
+	unsigned char ttl = 1;
+	unsigned char zero = 0;
+	netsock_t *sock = &network->peerrecv;
+
+	sock->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock->sock < 0) {
+		ERROR(("network_init: Error creating peer repair socket"));
+	}
+	sock->saddr.sin_family = PF_INET;
+	sock->saddr.sin_port = htons(options->ip_port + 3);
+	sock->saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sock->sock, (struct sockaddr *)&sock->saddr,
+		 sizeof(struct sockaddr_in)) < 0) {
+		ERROR(("network_init: Error binding peer repair socket"));
+	}
+	if (fcntl(sock->sock, F_SETFL, O_NONBLOCK) == -1) {
+		ERROR(("network_init: Error setting peer repair socket O_NONBLOCK"));
+	}
+	sock->imreq.imr_multiaddr.s_addr = options->ip_addr;
+	sock->imreq.imr_interface.s_addr = INADDR_ANY;
+	setsockopt(sock->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		   (const void *)&sock->imreq, sizeof(struct ip_mreq));
+
+	sock = &network->peernack;
+	sock->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock->sock < 0) {
+		ERROR(("network_init: Error creating peer repair socket"));
+	}
+	setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+		   sizeof(unsigned char));
+	setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &zero,
+		   sizeof(unsigned char));
+	sock->saddr.sin_family = PF_INET;
+	sock->saddr.sin_addr.s_addr = options->ip_addr;
+	sock->saddr.sin_port = htons(options->ip_port + 3);
+	network->peerdata = *sock;
+	network->peerdata.saddr.sin_port = htons(options->ip_port);
+	return 1;
+}
+
+/* receiver's data sockets: busy poll the device queue instead of waiting
+ * for its interrupt, and kernel receive times for the capture */
+int udp_data_init(options_t * options, network_t * network, netsock_t * sock)
+{
+#if defined(SO_TIMESTAMPNS) && !defined(__KLIBC__)
+	int one = 1;
+#endif
+
+#ifdef SO_BUSY_POLL
+	if (options->busypoll
+	    && setsockopt(sock->sock, SOL_SOCKET, SO_BUSY_POLL,
+			  &options->busypoll, sizeof(options->busypoll))) {
+		do_printf
+		    ("Unable to busy poll for %dus, above net.core.busy_read it needs CAP_NET_ADMIN\n",
+		     options->busypoll);
+	}
+#else
+	if (options->busypoll) {
+		do_printf("Busy poll is not supported, ignored\n");
+	}
+#endif
+#if defined(SO_TIMESTAMPNS) && !defined(__KLIBC__)
+	if (network->capture) {
+		setsockopt(sock->sock, SOL_SOCKET, SO_TIMESTAMPNS, &one,
+			   sizeof(one));
+	}
+#endif
+	return 1;
+}
+
+/* Layered multicast. Sender: the egress sockets, sending to the next
+ * groups. Receiver: one socket per layer bound to its group, joined on
+ * demand, so that we know which layer each message came through */
+int udp_layers_init(options_t * options, network_t * network)
+{
+	netsock_t *sock;
+	int i, l, reuse = 1, zero = 0;
+
+	for (l = 0; l < options->layers; l++) {
+		for (i = 0; i < network->negress || (!l && !i); i++) {
+			if (!l) {
+				network->layer[0][i] = options->sender ?
+				    network->egress[i] : &network->data;
+				continue;
+			}
+			sock = malloc(sizeof(netsock_t));
+			if (!sock) {
+				ERROR(("network_init: Not enough memory"));
+			}
+			network->layer[l][i] = sock;
+			if (options->sender) {
+				*sock = *network->egress[i];
+				sock->saddr.sin_addr.s_addr =
+				    htonl(ntohl(options->ip_addr) + l);
+				continue;
+			}
+			memset(sock, 0, sizeof(netsock_t));
+			sock->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+			if (sock->sock < 0) {
+				ERROR(("network_init: Error creating layer socket"));
+			}
+			setsockopt(sock->sock, SOL_SOCKET, SO_REUSEADDR,
+				   &reuse, sizeof(reuse));
+#ifdef IP_MULTICAST_ALL
+			setsockopt(sock->sock, IPPROTO_IP, IP_MULTICAST_ALL,
+				   &zero, sizeof(zero));
+#endif
+			sock->saddr.sin_family = PF_INET;
+			sock->saddr.sin_port = htons(options->ip_port);
+			sock->saddr.sin_addr.s_addr =
+			    htonl(ntohl(options->ip_addr) + l);
+			if (bind(sock->sock, (struct sockaddr *)&sock->saddr,
+				 sizeof(struct sockaddr_in)) < 0) {
+				ERROR(("network_init: Error binding layer socket"));
+			}
+			if (fcntl(sock->sock, F_SETFL, O_NONBLOCK) == -1) {
+				ERROR(("network_init: Error setting layer socket O_NONBLOCK"));
+			}
+			udp_data_init(options, network, sock);
+			sock->imreq.imr_multiaddr = sock->saddr.sin_addr;
+			sock->imreq.imr_interface.s_addr = INADDR_ANY;
+		}
+	}
+	return 1;
+}
+
+/* the keepalives of the other receivers, and our own */
+int udp_feedback_init(options_t * options, network_t * network)
+{
+	netsock_t *sock = &network->feedback;
+	int reuse = 1;
+
+	sock->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock->sock < 0) {
+		ERROR(("network_init: Error creating feedback socket"));
+	}
+	setsockopt(sock->sock, SOL_SOCKET, SO_REUSEADDR, &reuse,
+		   sizeof(reuse));
+	sock->saddr.sin_family = PF_INET;
+	sock->saddr.sin_port = htons(options->ip_port + 1);
+	sock->saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sock->sock, (struct sockaddr *)&sock->saddr,
+		 sizeof(struct sockaddr_in)) < 0) {
+		ERROR(("network_init: Error binding feedback socket"));
+	}
+	if (fcntl(sock->sock, F_SETFL, O_NONBLOCK) == -1) {
+		ERROR(("network_init: Error setting feedback socket O_NONBLOCK"));
+	}
+	sock->imreq.imr_multiaddr.s_addr = options->ip_addr;
+	sock->imreq.imr_interface.s_addr = INADDR_ANY;
+	setsockopt(sock->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		   (const void *)&sock->imreq, sizeof(struct ip_mreq));
+	network->probability = PROBABILITY_ONE;
+	return 1;
+}
+
+int udp_init(options_t * options, network_t * network)
+{
+	unsigned char ttl = 3;
+	unsigned char one = 1;
+	int i, reuse = 1, zero = 0;
 
 	network->data.sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
 	if (network->data.sock < 0) {
@@ -432,34 +1383,49 @@ int network_init(options_t * options, network_t * network)
 		network->data.saddr.sin_port = htons(options->ip_port);
 	}
 	network->data.saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	/* the other layers are bound to their group on the same port, and
+	 * only go to their socket */
+	if (!options->sender && options->layers > 1) {
+		setsockopt(network->data.sock, SOL_SOCKET, SO_REUSEADDR,
+			   &reuse, sizeof(reuse));
+#ifdef IP_MULTICAST_ALL
+		setsockopt(network->data.sock, IPPROTO_IP, IP_MULTICAST_ALL,
+			   &zero, sizeof(zero));
+#endif
+	}
 	network->data.status =
 	    bind(network->data.sock, (struct sockaddr *)&network->data.saddr,
 		 sizeof(struct sockaddr_in));
 	if (network->data.status < 0) {
 		ERROR(("network_init: Error binding data socket to interface"));
 	}
+	/* the receiver drains its socket from the event loop */
+	if (!options->sender
+	    && fcntl(network->data.sock, F_SETFL, O_NONBLOCK) == -1) {
+		ERROR(("network_init: Error setting data socket O_NONBLOCK"));
+	}
+	if (!options->sender) {
+		udp_data_init(options, network, &network->data);
+	}
 
-	if (options->keepalives) {
+	if (options->keepalives || options->npeers) {
 		network->keepalive.sock =
 		    socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
 		if (network->keepalive.sock < 0) {
 			ERROR(("network_init: Error creating keepalive socket"));
 		}
+		/* cooperative senders, and receivers listening to the
+		 * feedback (-f), may share a host */
+		if (options->sender) {
+			setsockopt(network->keepalive.sock, SOL_SOCKET,
+				   SO_REUSEADDR, &reuse, sizeof(reuse));
+		}
 		if (fcntl(network->keepalive.sock, F_SETFL, O_NONBLOCK) == -1) {
 			ERROR(("network_init: Error setting keepalive socket O_NONBLOCK"));
 		}
 		network->keepalive.saddr.sin_family = PF_INET;
 
 		if (options->sender) {
-			network->keepalives =
-			    malloc(sizeof(keepalive_t) * 256 * 256);
-			if (!network->keepalives) {
-				do_printf
-				    ("Unable to allocate keepalives table, exiting...");
-				exit(255);
-			}
-			memset(network->keepalives, 0,
-			       sizeof(keepalive_t) * 256 * 256);
 			network->keepalive.saddr.sin_port =
 			    htons(options->ip_port + 1);
 		} else {
@@ -508,30 +1474,58 @@ int network_init(options_t * options, network_t * network)
 	}
 
 	if (options->sender) {
-		/* data socket in send mode */
-		setsockopt(network->data.sock, IPPROTO_IP, IP_MULTICAST_IF,
-			   &network->data.iaddr, sizeof(struct in_addr));
-
-		setsockopt(network->data.sock, IPPROTO_IP, IP_MULTICAST_TTL,
-			   &ttl, sizeof(unsigned char));
+		/* data sockets in send mode, one per interface */
+		for (i = 0; i < options->ninterfaces; i++) {
+			udp_egress(options, network, i);
+		}
+		if (options->layers > 1) {
+			udp_layers_init(options, network);
+		}
 
-		setsockopt(network->data.sock, IPPROTO_IP, IP_MULTICAST_LOOP,
-			   &one, sizeof(unsigned char));
+		/* unicast repair requests */
+		if (options->repair) {
+			network->repair.sock =
+			    socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+			if (network->repair.sock < 0) {
+				ERROR(("network_init: Error creating repair socket"));
+			}
+			network->repair.saddr.sin_family = PF_INET;
+			network->repair.saddr.sin_port =
+			    htons(options->ip_port + 2);
+			network->repair.saddr.sin_addr.s_addr =
+			    htonl(INADDR_ANY);
+			if (bind(network->repair.sock,
+				 (struct sockaddr *)&network->repair.saddr,
+				 sizeof(struct sockaddr_in)) < 0) {
+				ERROR(("network_init: Error binding repair socket"));
+			}
+			if (fcntl(network->repair.sock, F_SETFL, O_NONBLOCK) ==
+			    -1) {
+				ERROR(("network_init: Error setting repair socket O_NONBLOCK"));
+			}
+		}
 
-		network->data.saddr.sin_addr.s_addr = options->ip_addr;
-		network->data.saddr.sin_port = htons(options->ip_port);
+		/* announcements to the other senders, through the first
+		 * interface */
+		if (options->npeers) {
+			network->announce = *network->egress[0];
+			network->announce.saddr.sin_port =
+			    htons(options->ip_port + 1);
+		}
 
-		/* keepalive socket in receive mode */
-		if (options->keepalives) {
+		/* keepalive socket in receive mode, clients may be behind any
+		 * of the interfaces */
+		if (options->keepalives || options->npeers) {
 			network->keepalive.imreq.imr_multiaddr.s_addr =
 			    options->ip_addr;
-			network->keepalive.imreq.imr_interface.s_addr =
-			    INADDR_ANY;
-
-			setsockopt(network->keepalive.sock, IPPROTO_IP,
-				   IP_ADD_MEMBERSHIP,
-				   (const void *)&network->keepalive.imreq,
-				   sizeof(struct ip_mreq));
+			for (i = 0; i < network->negress; i++) {
+				network->keepalive.imreq.imr_interface =
+				    network->egress[i]->iaddr;
+				setsockopt(network->keepalive.sock, IPPROTO_IP,
+					   IP_ADD_MEMBERSHIP, (const void *)
+					   &network->keepalive.imreq,
+					   sizeof(struct ip_mreq));
+			}
 		}
 
 	} else {
@@ -543,6 +1537,16 @@ int network_init(options_t * options, network_t * network)
 			   (const void *)&network->data.imreq,
 			   sizeof(struct ip_mreq));
 
+		if (options->layers > 1) {
+			udp_layers_init(options, network);
+		}
+		if (options->peerrepair) {
+			udp_peers_init(options, network);
+		}
+		if (options->feedback) {
+			udp_feedback_init(options, network);
+		}
+
 		/* keepalive socket in send mode */
 		if (options->keepalives) {
 			setsockopt(network->keepalive.sock, IPPROTO_IP,
@@ -564,30 +1568,188 @@ int network_init(options_t * options, network_t * network)
 		}
 
 	}
-	DEBUGP(("network_init: Exit\n"));
+	DEBUGP(("udp_init: Exit\n"));
+	return 1;
+}
+
+int udp_send(network_t * network, netsock_t * sock, void *data, int len)
+{
+	return sendto(sock->sock, data, len, 0,
+		      (struct sockaddr *)&sock->saddr,
+		      sizeof(struct sockaddr_in));
+}
+
+int udp_recv(network_t * network, netsock_t * sock, void *data, int len)
+{
+	socklen_t socklen = sizeof(struct sockaddr_in);
+#if defined(SO_TIMESTAMPNS) && !defined(__KLIBC__)
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct cmsghdr *cmsg;
+	struct timespec *ts;
+	struct msghdr msg;
+	struct iovec iov;
+	int status;
+
+	/* capturing: the time the datagram reached the socket, not the
+	 * time we got to it */
+	if (network->capture) {
+		iov.iov_base = data;
+		iov.iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sock->saddr;
+		msg.msg_namelen = socklen;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		status = recvmsg(sock->sock, &msg, 0);
+		sock->stamp = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); status > 0 && cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET
+			    && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				ts = (struct timespec *)CMSG_DATA(cmsg);
+				sock->stamp = ts->tv_sec * 1000000000ULL +
+				    ts->tv_nsec;
+			}
+		}
+		return status;
+	}
+#endif
+	return recvfrom(sock->sock, data, len, 0,
+			(struct sockaddr *)&sock->saddr, &socklen);
+}
+
+time_t udp_time(network_t * network)
+{
+	return time(NULL);
+}
+
+int udp_clean(network_t * network)
+{
+	int i, l;
+
+	/* the sender's layers share the egress sockets */
+	for (l = 1; l < MAXLAYERS; l++) {
+		for (i = 0; i < MAXINTERFACES && network->layer[l][i]; i++) {
+			if (network->layer[l][i]->sock !=
+			    network->layer[0][i]->sock) {
+				close(network->layer[l][i]->sock);
+			}
+			free(network->layer[l][i]);
+		}
+	}
+	for (i = 1; i < network->negress; i++) {
+		close(network->egress[i]->sock);
+		free(network->egress[i]);
+	}
+	if (network->repair.sock && network->repair.sock != network->data.sock) {
+		close(network->repair.sock);
+	}
+	if (network->peerrecv.sock) {
+		close(network->peerrecv.sock);
+		close(network->peernack.sock);
+	}
+	if (network->feedback.sock) {
+		close(network->feedback.sock);
+	}
+	shutdown(network->data.sock, 2);
+	close(network->data.sock);
+	return 1;
+}
+
+transport_t udp_transport = {
+	.init = udp_init,
+	.send = udp_send,
+	.recv = udp_recv,
+	.time = udp_time,
+	.clean = udp_clean,
+};
+
+int network_capture_init(options_t * options, network_t * network)
+{
+	capture_t header;
+	struct timeval tv;
+
+	network->capture = fopen(options->capture, "w");
+	if (!network->capture) {
+		ERROR(("network_capture_init: Unable to create '%s'\n",
+		       options->capture));
+	}
+	/* one write for many datagrams, on the receive path */
+	setvbuf(network->capture, NULL, _IOFBF, CAPTUREBUFFER);
+	gettimeofday(&tv, NULL);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.framesize = sizeof(message_t);
+	header.maxchunks = options->maxchunks;
+	header.realtime = tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+	network->capturens = trace_ns();
+	network->capturerealtime = header.realtime;
+	fwrite(&header, sizeof(header), 1, network->capture);
 	return 1;
 }
 
+int network_init(options_t * options, network_t * network)
+{
+	memset(network, 0, sizeof(network_t));
+	network->egress[0] = &network->data;
+	network->negress = 1;
+	network->transport = options->transport;
+	if (!network->transport) {
+		network->transport = &udp_transport;
+	}
+	/* cooperative senders read the keepalive port for announces, and
+	 * whatever keepalives come with them */
+	if (options->sender && (options->keepalives || options->npeers)) {
+		network->keepalives = malloc(sizeof(keepalive_t) * 256 * 256);
+		if (!network->keepalives) {
+			do_printf
+			    ("Unable to allocate keepalives table, exiting...");
+			exit(255);
+		}
+		memset(network->keepalives, 0, sizeof(keepalive_t) * 256 * 256);
+	}
+	if (!options->sender && options->capture) {
+		network_capture_init(options, network);
+	}
+	return network->transport->init(options, network);
+}
+
+time_t network_time(network_t * network)
+{
+	return network->transport->time(network);
+}
+
+/* the completion % rides in the top byte of the id */
 int network_send_keepalive(network_t * network)
 {
+	uint32_t id;
+
+	id = htonl(ntohl(network->id) | network->completion << 24);
+	trace(TRACE_KEEPALIVE_SEND, ntohl(id));
 	network->keepalive.status =
-	    sendto(network->keepalive.sock, (void *)&network->id,
-		   sizeof(network->id), 0,
-		   (struct sockaddr *)&network->keepalive.saddr,
-		   sizeof(struct sockaddr_in));
+	    network->transport->send(network, &network->keepalive,
+				     (void *)&id, sizeof(id));
 	return 1;
 }
 
-int network_send(network_t * network, message_t * message)
+int network_send_egress(network_t * network, int egress, message_t * message)
 {
-	network->data.status =
-	    sendto(network->data.sock, (void *)message, sizeof(message_t), 0,
-		   (struct sockaddr *)&network->data.saddr,
-		   sizeof(struct sockaddr_in));
+	netsock_t *sock = network->egress[egress];
+
+	sock->status =
+	    network->transport->send(network, sock, (void *)message,
+				     sizeof(message_t));
 	DEBUGP(("network_send: message %ld\n", message->chunk.n));
 	return 1;
 }
 
+int network_send(network_t * network, message_t * message)
+{
+	return network_send_egress(network, 0, message);
+}
+
 int network_dump_keepalives(options_t * options, network_t * network)
 {
 	int k, keepalives;
@@ -618,36 +1780,173 @@ int network_dump_keepalives(options_t * options, network_t * network)
 	return keepalives;
 }
 
+int network_announce(options_t * options, network_t * network,
+		     buffer_t * buffer)
+{
+	announce_t announce;
+
+	network->length = buffer->length;
+	network->nchunks = buffer->nchunks;
+	memset(&announce, 0, sizeof(announce));
+	announce.magic = htonl(ANNOUNCE_MAGIC);
+	announce.index = htons(options->peerindex);
+	announce.count = htons(options->npeers);
+	announce.length = htonl(buffer->length);
+	announce.nchunks = htonl(buffer->nchunks);
+	network->announce.status =
+	    network->transport->send(network, &network->announce,
+				     (void *)&announce, sizeof(announce));
+	return 1;
+}
+
+int network_recv_announce(options_t * options, network_t * network,
+			  announce_t * announce, time_t now)
+{
+	int index = ntohs(announce->index);
+
+	if (ntohl(announce->magic) != ANNOUNCE_MAGIC
+	    || ntohs(announce->count) != options->npeers
+	    || index >= options->npeers || index == options->peerindex) {
+		DEBUGP(("network_recv_announce: ignored\n"));
+		return 0;
+	}
+	if (ntohl(announce->length) != network->length
+	    || ntohl(announce->nchunks) != network->nchunks) {
+		DEBUGP(("network_recv_announce: peer %d has another image\n",
+			index));
+		return 0;
+	}
+	network->peers[index] = now;
+	return 1;
+}
+
+int network_recv_ack(options_t * options, network_t * network, ack_t * ack,
+		     time_t now)
+{
+	uint32_t id = ntohl(ack->id);
+	keepalive_t *client = &network->keepalives[id % 65536];
+
+	if (ntohl(ack->magic) != ACK_MAGIC || ntohl(ack->seq) != network->seq) {
+		return 0;
+	}
+	trace(TRACE_KEEPALIVE_RECV, id);
+	if (!client->acked) {
+		network->acks++;
+	}
+	client->time = now;
+	client->value = id >> 16;
+	client->seen = 1;
+	client->acked = 1;
+	return 1;
+}
+
+/* Live senders, as a bitmask of peer indexes. A peer that was never heard
+ * of is assumed to be there during the first PEERTIMEOUT seconds */
+uint32_t network_peers(options_t * options, network_t * network,
+		       time_t starttime)
+{
+	uint32_t alive = 0, changed;
+	time_t now;
+	int i;
+
+	now = network_time(network);
+	for (i = 0; i < options->npeers; i++) {
+		if (i == options->peerindex
+		    || difftime(now, network->peers[i]) <= PEERTIMEOUT
+		    || (!network->peers[i]
+			&& difftime(now, starttime) <= PEERTIMEOUT)) {
+			alive |= 1U << i;
+		}
+	}
+	changed = alive ^ network->peers_alive;
+	for (i = 0; options->verbose && i < options->npeers; i++) {
+		if (!(changed & (1U << i)) || !network->peers_alive) {
+			continue;
+		}
+		if (alive & (1U << i)) {
+			do_printf("peer %d/%d is back\n", i, options->npeers);
+		} else {
+			do_printf("peer %d/%d is down, taking over its share\n",
+				  i, options->npeers);
+		}
+	}
+	network->peers_alive = alive;
+	return alive;
+}
+
+/* Sender of <chunk>: peer <chunk % npeers>, or if it is down the live
+ * peers share its chunks round robin */
+int network_peer_owner(options_t * options, network_t * network,
+		       uint32_t chunk)
+{
+	uint32_t alive = network->peers_alive;
+	int owner, n = 0, k;
+
+	owner = chunk % options->npeers;
+	if (!alive || alive & (1U << owner)) {
+		return owner;
+	}
+	for (k = 0; k < options->npeers; k++) {
+		if (alive & (1U << k)) {
+			n++;
+		}
+	}
+	k = (chunk / options->npeers) % n;
+	for (owner = 0; owner < options->npeers; owner++) {
+		if ((alive & (1U << owner)) && !k--) {
+			break;
+		}
+	}
+	return owner;
+}
+
 int network_recv_keepalives(options_t * options, network_t * network,
 			    time_t starttime)
 {
-	socklen_t socklen = sizeof(struct sockaddr_in);
+	union {
+		uint32_t id;
+		announce_t announce;
+		ack_t ack;
+		report_t report;
+	} packet;
 	uint32_t id;
 	int k, keepalives;
-	time_t ref;
+	time_t now, ref;
 	keepalive_t *ktable;
 
+	now = network_time(network);
 	do {
 		network->keepalive.status =
-		    recvfrom(network->keepalive.sock, (void *)&id, sizeof(id),
-			     0, (struct sockaddr *)&network->keepalive.saddr,
-			     &socklen);
-		if (network->keepalive.status > 0) {
-			id = ntohl(id);
+		    network->transport->recv(network, &network->keepalive,
+					     (void *)&packet, sizeof(packet));
+		if (network->keepalive.status == sizeof(announce_t)) {
+			network_recv_announce(options, network,
+					      &packet.announce, now);
+		} else if (network->keepalive.status == sizeof(ack_t)) {
+			network_recv_ack(options, network, &packet.ack, now);
+		} else if (network->keepalive.status == sizeof(report_t)
+			   || network->keepalive.status == sizeof(id)) {
+			id = ntohl(packet.id);
+			trace(TRACE_KEEPALIVE_RECV, id);
 			if (options->verbose) {
 				do_printf
-				    ("Received keepalive (%d) from client %d.%d, with value %d\n",
+				    ("Received keepalive (%d) from client %d.%d, with value %d, %d%% done\n",
 				     id, (id % 65536) / 256, id % 256,
-				     id / 65536);
+				     (id >> 16) & 0xff, id >> 24);
+			}
+			network->keepalives[id % 65536].time = now;
+			network->keepalives[id % 65536].value = id >> 16;
+			network->keepalives[id % 65536].completion = id >> 24;
+			network->keepalives[id % 65536].seen = 1;
+			if (network->keepalive.status == sizeof(report_t)) {
+				network->heard += ntohl(packet.report.weight);
 			}
-			network->keepalives[id % 65536].time = time(NULL);
-			network->keepalives[id % 65536].value = id / 65536;
 		}
 	}
 	while (network->keepalive.status > 0);
 
 	keepalives = 0;
-	ref = time(NULL) - (options->maxwait);
+	ref = now - (options->maxwait);
 	if (difftime(starttime, ref) > 0) {
 		keepalives++;
 	}
@@ -668,142 +1967,1799 @@ int network_recv_keepalives(options_t * options, network_t * network,
 	return (keepalives);
 }
 
-int network_recv(options_t * options, network_t * network, message_t * message)
+/* clients ever heard of, and how many of them reported completion */
+int network_clients(network_t * network, int *done)
 {
-	socklen_t socklen = sizeof(struct sockaddr_in);
-
-	network->data.status =
-	    recvfrom(network->data.sock, (void *)message, sizeof(message_t), 0,
-		     (struct sockaddr *)&network->data.saddr, &socklen);
-
-	if (!network->received_packets) {
-		/* This is the first packet we received, Call statuscmd */
-		do_statuscmd(options, 0);
+	int k, clients = 0;
+
+	*done = 0;
+	for (k = 0; network->keepalives && k < 256 * 256; k++) {
+		if (network->keepalives[k].seen) {
+			clients++;
+			if (network->keepalives[k].completion == 100) {
+				(*done)++;
+			}
+		}
 	}
-
-	network->received_packets++;
-	DEBUGP(("network_recv: message %ld\n", message->chunk.n));
-	return 1;
+	return clients;
 }
 
-int network_clean(network_t * network)
+/* a keepalive that stands for <weight> client-milliseconds */
+int network_send_report(network_t * network, uint32_t weight)
 {
-	shutdown(network->data.sock, 2);
-	close(network->data.sock);
+	report_t report;
+
+	report.id = htonl(ntohl(network->id) | network->completion << 24);
+	report.weight = htonl(weight);
+	trace(TRACE_KEEPALIVE_SEND, ntohl(report.id));
+	network->keepalive.status =
+	    network->transport->send(network, &network->keepalive,
+				     (void *)&report, sizeof(report));
 	return 1;
 }
 
-int buffer_init(options_t * options, buffer_t * buffer, FILE * file)
+/* Receiver: what the others sent to the keepalive port. Reports are
+ * summed up to estimate the fleet, and a keepalive from a receiver with
+ * the same value that is not further than us makes ours useless */
+int network_recv_feedback(options_t * options, network_t * network)
 {
-	uint32_t length;
-	uint16_t i;
-	int lr;
-
-	length = 0;
-	i = 0;
-	buffer->last_chunk_number = 0;
-	buffer->chunks = malloc(sizeof(chunk_t) * options->maxchunks);
-	if (buffer->chunks) {
-		memset(buffer->chunks, 0, sizeof(chunk_t) * options->maxchunks);
-		buffer->maxchunks = options->maxchunks;
-		if (file) {
-			DEBUGP(("buffer_init: Start to read file\n"));
-			do {
-				lr = fread(buffer->chunks[i].data, 1, CHUNKSIZE,
-					   file);
-				if (lr) {
-					if (i > (options->maxchunks - 1)) {
-						ERROR(("buffer_init: Too much data, stop reading after %ld chunks\n", i));
-					}
-					buffer->chunks[i].n = i + 1;
-					buffer->chunks[i].returnvalue =
-					    options->returnvalue;
-					i++;
-					length += lr;
-				}
-			} while (lr == CHUNKSIZE);
-		}
-		buffer->nchunks = i;
-		buffer->length = length;
-		DEBUGP(("buffer_init: Exit\n"));
-		return 1;
-	} else {
-		ERROR(("buffer_init: Not enough memory"));
-	}
-}
+	union {
+		uint32_t id;
+		report_t report;
+	} packet;
+	uint32_t id;
+	int n = 0;
 
-int buffer_recv(options_t * options, buffer_t * buffer, message_t * message)
-{
-	uint32_t crc, crcmsg;
+	for (;;) {
+		network->feedback.status =
+		    network->transport->recv(network, &network->feedback,
+					     (void *)&packet, sizeof(packet));
+		if (network->feedback.status <= 0) {
+			break;
+		}
+		if (network->feedback.status != sizeof(id)
+		    && network->feedback.status != sizeof(report_t)) {
+			continue;
+		}
+		id = ntohl(packet.id);
+		if (id % 65536 == ntohl(network->id) % 65536) {
+			continue;
+		}
+		if (network->feedback.status == sizeof(report_t)) {
+			network->heard += ntohl(packet.report.weight);
+		}
+		if (((id >> 16) & 0xff) == options->returnvalue
+		    && (id >> 24) <= network->completion) {
+			network->suppressed = 1;
+		}
+		n++;
+	}
+	return n;
+}
+
+/* Receiver, every <elapsed> ms: the fleet is estimated from the reports
+ * heard meanwhile, and we report with the probability that makes about
+ * FEEDBACKREPORTS reports per keepalive period whatever its size. When we
+ * don't, a keepalive is still sent if nobody as far behind was heard.
+ * Returns the delay until the next call, drawn in [maxwait/2, maxwait[ so
+ * that the sender never times out and receivers started together spread */
+long network_send_feedback(options_t * options, network_t * network,
+			   long elapsed)
+{
+	long period = options->maxwait * 1000L;
+	double clients, weight;
+
+	if (elapsed > 0) {
+		clients = network->heard / elapsed + 1;
+		if (clients > FEEDBACKREPORTS) {
+			network->probability =
+			    PROBABILITY_ONE * FEEDBACKREPORTS / clients;
+		} else {
+			network->probability = PROBABILITY_ONE;
+		}
+		if (!network->probability) {
+			network->probability = 1;
+		}
+	}
+	if (rand() % PROBABILITY_ONE < network->probability) {
+		/* our mean period is 3/4 maxwait */
+		weight = (double)period * 3 / 4 * PROBABILITY_ONE /
+		    network->probability;
+		network_send_report(network, weight < UINT32_MAX ?
+				    weight : UINT32_MAX);
+	} else if (!network->suppressed) {
+		network_send_keepalive(network);
+	}
+	network->suppressed = 0;
+	network->heard = 0;
+	return period / 2 + rand() % (period / 2);
+}
+
+/* Sender: clients the reports stood for, updated every maxwait */
+uint32_t network_fleet(options_t * options, network_t * network)
+{
+	time_t now = network_time(network);
+	double elapsed;
+	uint32_t fleet;
+
+	if (!network->heardsince) {
+		network->heardsince = now;
+	}
+	elapsed = difftime(now, network->heardsince);
+	if (elapsed < options->maxwait) {
+		return network->fleet;
+	}
+	fleet = network->heard / (elapsed * 1000) + 0.5;
+	/* a few reports per period, smooth it a bit */
+	if (network->fleet) {
+		fleet = (network->fleet + fleet + 1) / 2;
+	}
+	if (fleet != network->fleet && options->verbose) {
+		do_printf("About %u clients, from sampled keepalives\n", fleet);
+	}
+	network->fleet = fleet;
+	network->heard = 0;
+	network->heardsince = now;
+	return fleet;
+}
+
+/* command mode: each call sends the same command, with the sequence
+ * number picked at the first one */
+int network_send_command(options_t * options, network_t * network,
+			 uint8_t returnvalue)
+{
+	command_t command;
+
+	if (!network->seq) {
+		network->seq = time(NULL);
+	}
+	memset(&command, 0, sizeof(command));
+	command.magic = htonl(COMMAND_MAGIC);
+	command.seq = htonl(network->seq);
+	command.time = htonl(network_time(network));
+	command.returnvalue = returnvalue;
+	if (options->keylength) {
+		command.hmac = 1;
+		hmac_sha256(options->key, options->keylength,
+			    (uint8_t *) & command,
+			    offsetof(command_t, crc), command.mac);
+	}
+	command.crc = htonl(crc32((uint8_t *) & command, sizeof(command)));
+	network->data.status =
+	    network->transport->send(network, &network->data,
+				     (void *)&command, sizeof(command));
+	trace(TRACE_SEND, 0);
+	return 1;
+}
+
+/* receiver: 1 if <command> is to be obeyed. With a key, only signed
+ * commands are, sent within COMMANDWINDOW seconds of our clock, and a
+ * sequence number never goes back */
+int network_check_command(options_t * options, network_t * network,
+			  command_t * command)
+{
+	uint8_t mac[DIGESTSIZE];
+	uint32_t crc;
+	long age;
+
+	if (ntohl(command->magic) != COMMAND_MAGIC) {
+		return 0;
+	}
+	crc = command->crc;
+	command->crc = 0;
+	if (ntohl(crc) != crc32((uint8_t *) command, sizeof(command_t))) {
+		trace(TRACE_CRCFAIL, 0);
+		return 0;
+	}
+	if (options->keylength) {
+		hmac_sha256(options->key, options->keylength,
+			    (uint8_t *) command, offsetof(command_t, crc), mac);
+		if (!command->hmac || memcmp(mac, command->mac, DIGESTSIZE)) {
+			if (options->verbose) {
+				do_printf("Command with a bad signature ignored\n");
+			}
+			return 0;
+		}
+		age = (long)network_time(network) - (long)ntohl(command->time);
+		if (age > COMMANDWINDOW || age < -COMMANDWINDOW) {
+			if (options->verbose) {
+				do_printf
+				    ("Command sent %lds away from our clock ignored\n",
+				     age);
+			}
+			return 0;
+		}
+	}
+	if (ntohl(command->seq) < network->seq) {
+		return 0;
+	}
+	network->seq = ntohl(command->seq);
+	trace(TRACE_CONTROL, command->returnvalue);
+	return 1;
+}
+
+int network_send_ack(network_t * network, uint32_t seq, uint8_t value)
+{
+	ack_t ack;
+
+	ack.magic = htonl(ACK_MAGIC);
+	ack.id = htonl((ntohl(network->id) & 0xffff) | value << 16);
+	ack.seq = htonl(seq);
+	network->keepalive.status =
+	    network->transport->send(network, &network->keepalive,
+				     (void *)&ack, sizeof(ack));
+	return 1;
+}
+
+/* command mode summary: acknowledgements per return value */
+int network_dump_acks(options_t * options, network_t * network)
+{
+	int k, v, values[256];
+	FILE *fd = NULL;
+
+	memset(values, 0, sizeof(values));
+	for (k = 0; network->keepalives && k < 256 * 256; k++) {
+		if (network->keepalives[k].acked) {
+			values[network->keepalives[k].value]++;
+		}
+	}
+	if (options->output) {
+		fd = fopen(options->output, "w");
+	}
+	if (!fd) {
+		fd = stderr;
+	}
+	fprintf(fd, "command %u: %d clients acknowledged\n", network->seq,
+		network->acks);
+	for (v = 0; v < 256; v++) {
+		if (values[v]) {
+			fprintf(fd, "value: %d clients: %d\n", v, values[v]);
+		}
+	}
+	for (k = 0; options->verbose && network->keepalives && k < 256 * 256;
+	     k++) {
+		if (network->keepalives[k].acked) {
+			fprintf(fd, "client: %d.%d value: %d\n", k / 256,
+				k % 256, network->keepalives[k].value);
+		}
+	}
+	if (fd != stderr) {
+		fclose(fd);
+	}
+	return network->acks;
+}
+
+/* receiver: requests go to port+2 of the host the repair announce came
+ * from, through the data socket so that replies come back on it */
+int network_repair_init(options_t * options, network_t * network)
+{
+	network->repair = network->data;
+	network->repair.saddr.sin_port = htons(options->ip_port + 2);
+	network->repairing = 1;
+	return 1;
+}
+
+/* receiver: ask for the first missing chunk ranges */
+int network_send_repair(network_t * network, buffer_t * buffer)
+{
+	repair_t request;
+	uint32_t i, first;
+
+	if (!buffer->present) {
+		return 0;
+	}
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(REPAIR_MAGIC);
+	request.id = network->id;
+	for (i = buffer->contiguous;
+	     i < buffer->nchunks && request.nranges < REPAIRRANGES; i++) {
+		if (buffer_has(buffer, i)) {
+			continue;
+		}
+		first = i;
+		while (i < buffer->nchunks && !buffer_has(buffer, i)) {
+			i++;
+		}
+		request.ranges[request.nranges].first = htonl(first);
+		request.ranges[request.nranges].count = htonl(i - first);
+		request.nranges++;
+	}
+	if (!request.nranges) {
+		return 0;
+	}
+	trace(TRACE_REPAIR, buffer->nchunks - buffer->received);
+	request.nranges = htonl(request.nranges);
+	network->repair.status =
+	    network->transport->send(network, &network->repair,
+				     (void *)&request, sizeof(request));
+	return 1;
+}
+
+/* peer repair: ask the segment for the chunks missing before <upto>,
+ * those another receiver just asked for (<requested>) excepted */
+int network_send_nack(network_t * network, buffer_t * buffer,
+		      uint8_t * requested, uint32_t upto)
+{
+	repair_t request;
+	uint32_t i, first, missing = 0;
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(REPAIR_MAGIC);
+	request.id = network->id;
+	for (i = buffer->contiguous; i < upto && request.nranges < REPAIRRANGES;
+	     i++) {
+		if (buffer_has(buffer, i) || requested[i / 8] & (1 << (i % 8))) {
+			continue;
+		}
+		first = i;
+		while (i < upto && !buffer_has(buffer, i)
+		       && !(requested[i / 8] & (1 << (i % 8)))) {
+			i++;
+		}
+		request.ranges[request.nranges].first = htonl(first);
+		request.ranges[request.nranges].count = htonl(i - first);
+		request.nranges++;
+		missing += i - first;
+	}
+	if (!request.nranges) {
+		return 0;
+	}
+	trace(TRACE_REPAIR, missing);
+	request.nranges = htonl(request.nranges);
+	network->peernack.status =
+	    network->transport->send(network, &network->peernack,
+				     (void *)&request, sizeof(request));
+	return missing;
+}
+
+/* peer repair: next request heard, 0 once there are none left. Ours are
+ * not looped back */
+int network_recv_nack(network_t * network, repair_t * request)
+{
+	while ((network->peerrecv.status =
+		network->transport->recv(network, &network->peerrecv,
+					 (void *)request,
+					 sizeof(repair_t))) > 0) {
+		if (network->peerrecv.status == sizeof(repair_t)
+		    && ntohl(request->magic) == REPAIR_MAGIC
+		    && ntohl(request->nranges) <= REPAIRRANGES) {
+			request->nranges = ntohl(request->nranges);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int network_send_peer(network_t * network, message_t * message)
+{
+	network->peerdata.status =
+	    network->transport->send(network, &network->peerdata,
+				     (void *)message, sizeof(message_t));
+	trace(TRACE_SEND, message->chunk.n);
+	return 1;
+}
+
+/* sender: answer pending requests, at most REPAIRBUDGET chunks each, the
+ * receivers ask again for what is still missing */
+int network_serve_repair(options_t * options, network_t * network,
+			 buffer_t * buffer)
+{
+	repair_t request;
+	message_t message, *frame;
+	uint32_t r, i, first, count, budget;
+	int served = 0;
+
+	while ((network->repair.status =
+		network->transport->recv(network, &network->repair,
+					 (void *)&request,
+					 sizeof(request))) > 0) {
+		if (network->repair.status != sizeof(request)
+		    || ntohl(request.magic) != REPAIR_MAGIC
+		    || ntohl(request.nranges) > REPAIRRANGES) {
+			continue;
+		}
+		if (buffer->hasdigest) {
+			buffer_control(buffer, CONTROL_DIGEST, buffer->digest,
+				       DIGESTSIZE, &message);
+			network->transport->send(network, &network->repair,
+						 (void *)&message,
+						 sizeof(message));
+		}
+		budget = REPAIRBUDGET;
+		for (r = 0; r < ntohl(request.nranges) && budget; r++) {
+			first = ntohl(request.ranges[r].first);
+			count = ntohl(request.ranges[r].count);
+			if (first >= buffer->nchunks
+			    || count > buffer->nchunks - first) {
+				break;
+			}
+			for (i = first; i < first + count && budget; i++) {
+				frame = buffer_frame(buffer, i, &message);
+				network->transport->send(network,
+							 &network->repair,
+							 (void *)frame,
+							 sizeof(message_t));
+				budget--;
+			}
+		}
+		trace(TRACE_REPAIR, REPAIRBUDGET - budget);
+		if (options->verbose) {
+			do_printf("repair: %d chunks sent to client %d.%d\n",
+				  REPAIRBUDGET - budget,
+				  (ntohl(request.id) % 65536) / 256,
+				  ntohl(request.id) % 256);
+		}
+		served++;
+	}
+	return served;
+}
+
+int network_recv(options_t * options, network_t * network, message_t * message)
+{
+	return network_recv_layer(options, network, 0, message);
+}
+
+int network_recv_layer(options_t * options, network_t * network, int layer,
+		       message_t * message)
+{
+	netsock_t *sock = layer ? network->layer[layer][0] : &network->data;
+	capturerecord_t record;
+
+	sock->status =
+	    network->transport->recv(network, sock, (void *)message,
+				     sizeof(message_t));
+	if (sock->status <= 0) {
+		return 0;
+	}
+
+	if (!network->received_packets) {
+		/* This is the first packet we received, Call statuscmd */
+		progress_report(network, 0);
+	}
+
+	network->received_packets++;
+	if (network->capture) {
+		memset(&record, 0, sizeof(record));
+		if (sock->stamp > network->capturerealtime) {
+			record.time = sock->stamp - network->capturerealtime;
+		} else {
+			record.time = trace_ns() - network->capturens;
+		}
+		record.length = sock->status;
+		record.layer = layer;
+		fwrite(&record, sizeof(record), 1, network->capture);
+		fwrite(message, sock->status, 1, network->capture);
+	}
+	DEBUGP(("network_recv: message %ld\n", message->chunk.n));
+	return 1;
+}
+
+int network_send_layer(network_t * network, int egress, int layer,
+		       message_t * message)
+{
+	netsock_t *sock = layer ? network->layer[layer][egress] :
+	    network->egress[egress];
+
+	sock->status =
+	    network->transport->send(network, sock, (void *)message,
+				     sizeof(message_t));
+	return 1;
+}
+
+int network_join_layer(options_t * options, network_t * network, int layer,
+		       int join)
+{
+	netsock_t *sock = network->layer[layer][0];
+
+	if (options->verbose) {
+		do_printf("%s layer %d\n", join ? "Joining" : "Leaving", layer);
+	}
+	return setsockopt(sock->sock, IPPROTO_IP,
+			  join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+			  (const void *)&sock->imreq,
+			  sizeof(struct ip_mreq)) == 0;
+}
+
+/* Layered multicast: in each block of 2^(layers-1) chunks, layer 0 sends
+ * one and layer l 2^(l-1), so that the cumulative rate doubles per layer.
+ * Which ones rotates with each loop: the layer is the bit length of the
+ * bit reversed offset, so the first k layers send the chunks at offsets
+ * 2^(layers-1-k) apart, shifted by one each loop, and all of them within
+ * 2^(layers-1-k) loops. */
+int chunk_layer(options_t * options, uint32_t chunk, uint32_t loop)
+{
+	uint32_t bits = options->layers - 1, offset, reversed = 0;
+	int i, layer = 0;
+
+	offset = (chunk + loop) & ((1U << bits) - 1);
+	for (i = 0; i < bits; i++) {
+		reversed |= ((offset >> i) & 1) << (bits - 1 - i);
+	}
+	for (; reversed; reversed >>= 1) {
+		layer++;
+	}
+	return layer;
+}
+
+int network_clean(network_t * network)
+{
+	if (network->capture) {
+		fclose(network->capture);
+		network->capture = NULL;
+	}
+	return network->transport->clean(network);
+}
+
+/* Event loop: sockets, periodic timers and signals are all dispatched from
+ * evloop_run, so handlers run in the main context and may do anything.
+ * It relies on epoll, timerfd and signalfd, and falls back on poll() with
+ * computed timeouts and a signal pipe where those are missing (klibc). */
+#ifndef __KLIBC__
+int evloop_init(evloop_t * loop)
+{
+	memset(loop, 0, sizeof(evloop_t));
+	loop->fd = epoll_create(MAXEVENTS);
+	if (loop->fd < 0) {
+		ERROR(("evloop_init: Unable to create epoll instance"));
+	}
+	return 1;
+}
+
+int evloop_add(evloop_t * loop, event_t * event)
+{
+	struct epoll_event ev;
+
+	if (loop->nevents == MAXEVENTS) {
+		ERROR(("evloop_add: Too many events"));
+	}
+	loop->events[loop->nevents++] = event;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = event;
+	if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, event->fd, &ev) < 0) {
+		ERROR(("evloop_add: Unable to watch fd %d", event->fd));
+	}
+	return 1;
+}
+
+int event_timer_set(event_t * event, long interval)
+{
+	struct itimerspec its;
+
+	event->interval = interval;
+	its.it_interval.tv_sec = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	return timerfd_settime(event->fd, 0, &its, NULL) == 0;
+}
+
+int event_timer(evloop_t * loop, event_t * event, long interval,
+		event_handler_t handler, void *data)
+{
+	memset(event, 0, sizeof(event_t));
+	event->type = EVENT_TIMER;
+	event->handler = handler;
+	event->data = data;
+	event->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (event->fd < 0) {
+		ERROR(("event_timer: Unable to create timer"));
+	}
+	event_timer_set(event, interval);
+	return evloop_add(loop, event);
+}
+
+int event_signals(evloop_t * loop, event_t * event, sigset_t * set,
+		  event_handler_t handler, void *data)
+{
+	memset(event, 0, sizeof(event_t));
+	event->type = EVENT_SIGNAL;
+	event->handler = handler;
+	event->data = data;
+	/* blocked in every thread created from now on, only delivered
+	 * through the signalfd */
+	sigprocmask(SIG_BLOCK, set, NULL);
+	event->fd = signalfd(-1, set, SFD_NONBLOCK);
+	if (event->fd < 0) {
+		ERROR(("event_signals: Unable to create signalfd"));
+	}
+	return evloop_add(loop, event);
+}
+
+int evloop_run(evloop_t * loop, int timeout)
+{
+	struct epoll_event evs[MAXEVENTS];
+	struct signalfd_siginfo si;
+	event_t *event;
+	uint64_t expirations;
+	int i, n;
+
+	n = epoll_wait(loop->fd, evs, MAXEVENTS, timeout);
+	for (i = 0; i < n && !loop->stop; i++) {
+		event = evs[i].data.ptr;
+		switch (event->type) {
+		case EVENT_TIMER:
+			if (read(event->fd, &expirations,
+				 sizeof(expirations)) > 0) {
+				event->handler(loop, event);
+			}
+			break;
+		case EVENT_SIGNAL:
+			while (read(event->fd, &si, sizeof(si)) == sizeof(si)) {
+				event->signo = si.ssi_signo;
+				event->handler(loop, event);
+			}
+			break;
+		default:
+			event->handler(loop, event);
+		}
+	}
+	return n;
+}
+
+int evloop_clean(evloop_t * loop)
+{
+	int i;
+
+	for (i = 0; i < loop->nevents; i++) {
+		if (loop->events[i]->type != EVENT_FD) {
+			close(loop->events[i]->fd);
+		}
+	}
+	close(loop->fd);
+	return 1;
+}
+#else
+int evloop_sigpipe[2];
+
+void evloop_sighandler(int signo)
+{
+	unsigned char c = signo;
+
+	signal(signo, evloop_sighandler);
+	write(evloop_sigpipe[1], &c, 1);
+}
+
+long evloop_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int evloop_init(evloop_t * loop)
+{
+	memset(loop, 0, sizeof(evloop_t));
+	return 1;
+}
+
+int evloop_add(evloop_t * loop, event_t * event)
+{
+	if (loop->nevents == MAXEVENTS) {
+		ERROR(("evloop_add: Too many events"));
+	}
+	loop->events[loop->nevents++] = event;
+	return 1;
+}
+
+int event_timer_set(event_t * event, long interval)
+{
+	event->interval = interval;
+	event->next = evloop_now() + interval;
+	return 1;
+}
+
+int event_timer(evloop_t * loop, event_t * event, long interval,
+		event_handler_t handler, void *data)
+{
+	memset(event, 0, sizeof(event_t));
+	event->type = EVENT_TIMER;
+	event->handler = handler;
+	event->data = data;
+	event->fd = -1;
+	event_timer_set(event, interval);
+	return evloop_add(loop, event);
+}
+
+int event_signals(evloop_t * loop, event_t * event, sigset_t * set,
+		  event_handler_t handler, void *data)
+{
+	int signo;
+
+	memset(event, 0, sizeof(event_t));
+	event->type = EVENT_SIGNAL;
+	event->handler = handler;
+	event->data = data;
+	if (pipe(evloop_sigpipe) < 0) {
+		ERROR(("event_signals: Unable to create signal pipe"));
+	}
+	fcntl(evloop_sigpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(evloop_sigpipe[1], F_SETFL, O_NONBLOCK);
+	event->fd = evloop_sigpipe[0];
+	for (signo = 1; signo < NSIG; signo++) {
+		if (sigismember(set, signo)) {
+			signal(signo, evloop_sighandler);
+		}
+	}
+	return evloop_add(loop, event);
+}
+
+int evloop_run(evloop_t * loop, int timeout)
+{
+	struct pollfd fds[MAXEVENTS];
+	event_t *events[MAXEVENTS];
+	event_t *event;
+	unsigned char c;
+	long now, wait;
+	int i, n, nfds = 0;
+
+	now = evloop_now();
+	for (i = 0; i < loop->nevents; i++) {
+		event = loop->events[i];
+		if (event->type == EVENT_TIMER) {
+			if (!event->interval) {
+				continue;
+			}
+			wait = event->next > now ? event->next - now : 0;
+			if (timeout < 0 || wait < timeout) {
+				timeout = wait;
+			}
+		} else {
+			fds[nfds].fd = event->fd;
+			fds[nfds].events = POLLIN;
+			events[nfds++] = event;
+		}
+	}
+	n = poll(fds, nfds, timeout);
+	for (i = 0; i < nfds && !loop->stop; i++) {
+		if (!(fds[i].revents & POLLIN)) {
+			continue;
+		}
+		event = events[i];
+		if (event->type == EVENT_SIGNAL) {
+			while (read(event->fd, &c, 1) == 1) {
+				event->signo = c;
+				event->handler(loop, event);
+			}
+		} else {
+			event->handler(loop, event);
+		}
+	}
+	now = evloop_now();
+	for (i = 0; i < loop->nevents && !loop->stop; i++) {
+		event = loop->events[i];
+		if (event->type == EVENT_TIMER && event->interval
+		    && event->next <= now) {
+			event->next = now + event->interval;
+			event->handler(loop, event);
+			n++;
+		}
+	}
+	return n;
+}
+
+int evloop_clean(evloop_t * loop)
+{
+	return 1;
+}
+#endif
+
+int event_fd(evloop_t * loop, event_t * event, int fd,
+	     event_handler_t handler, void *data)
+{
+	memset(event, 0, sizeof(event_t));
+	event->type = EVENT_FD;
+	event->fd = fd;
+	event->handler = handler;
+	event->data = data;
+	return evloop_add(loop, event);
+}
+
+/* anonymous memory for the sender's chunks, lazily backed by the kernel so
+ * there is no need to clear it, and with hugepages on demand */
+uint8_t *buffer_arena(options_t * options, size_t * size)
+{
+	uint8_t *arena = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (options->hugepages == HUGEPAGES_EXPLICIT) {
+		*size = (*size + HUGEPAGESIZE - 1) & ~(HUGEPAGESIZE - 1);
+		arena = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (arena == MAP_FAILED && options->verbose) {
+			do_printf
+			    ("No explicit hugepages available, trying transparent ones\n");
+		}
+	}
+#endif
+	if (arena == MAP_FAILED) {
+		arena = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (options->hugepages) {
+			madvise(arena, *size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	return arena;
+}
+
+/* Serve a regular file directly from the page cache, nothing is read
+ * before the first packet goes out. Returns 0 if the input can't be
+ * mapped (pipe, non aligned offset, hugepages requested, ...) */
+int buffer_map(options_t * options, buffer_t * buffer, FILE * file)
+{
+	struct stat st;
+	off_t offset;
+	int fd;
+
+	fd = fileno(file);
+	if (options->hugepages || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset % sysconf(_SC_PAGESIZE)
+	    || st.st_size <= offset) {
+		return 0;
+	}
+	if ((st.st_size - offset + CHUNKSIZE - 1) / CHUNKSIZE >
+	    options->maxchunks) {
+		ERROR(("buffer_init: Too much data, input is more than %d chunks\n", options->maxchunks));
+	}
+	buffer->datasize = st.st_size - offset;
+	buffer->data = mmap(NULL, buffer->datasize, PROT_READ, MAP_SHARED, fd,
+			    offset);
+	if (buffer->data == MAP_FAILED) {
+		buffer->data = NULL;
+		return 0;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, offset, buffer->datasize, POSIX_FADV_SEQUENTIAL);
+#endif
+	madvise(buffer->data, buffer->datasize, MADV_SEQUENTIAL);
+	madvise(buffer->data, buffer->datasize, MADV_WILLNEED);
+	buffer->mapped = 1;
+	buffer->length = buffer->datasize;
+	DEBUGP(("buffer_map: %ld bytes mapped\n", buffer->length));
+	return 1;
+}
+
+int buffer_load(options_t * options, buffer_t * buffer, FILE * file)
+{
+	size_t lr;
+
+	if (!buffer_map(options, buffer, file)) {
+		buffer->datasize = (size_t)options->maxchunks * CHUNKSIZE;
+		buffer->data = buffer_arena(options, &buffer->datasize);
+		if (!buffer->data) {
+			ERROR(("buffer_init: Not enough memory"));
+		}
+		DEBUGP(("buffer_init: Start to read file\n"));
+		do {
+			lr = fread(buffer->data + buffer->length, 1,
+				   (size_t)options->maxchunks * CHUNKSIZE -
+				   buffer->length, file);
+			buffer->length += lr;
+		} while (lr && buffer->length <
+			 (size_t)options->maxchunks * CHUNKSIZE);
+		if (buffer->length == (size_t)options->maxchunks * CHUNKSIZE
+		    && fgetc(file) != EOF) {
+			ERROR(("buffer_init: Too much data, stop reading after %d chunks\n", options->maxchunks));
+		}
+	}
+	buffer->nchunks = (buffer->length + CHUNKSIZE - 1) / CHUNKSIZE;
+	return 1;
+}
 
-	if ((message->chunk.n > 0) && (message->chunk.n <= buffer->maxchunks)) {
-		if (buffer->chunks[message->chunk.n - 1].n) {
-			DEBUGP(("buffer_recv: chunk %d already here\n",
-				message->chunk.n));
-			return 2;
+/* Streaming sender: read <file> into the arena, each chunk is published
+ * once complete, and the digest is computed on the way. The length is set
+ * last, frames are provisional until then */
+int buffer_stream(options_t * options, buffer_t * buffer, FILE * file)
+{
+	size_t lr, length = 0, capacity;
+	sha256_t ctx;
+
+	capacity = (size_t)options->maxchunks * CHUNKSIZE;
+	sha256_init(&ctx);
+	do {
+		lr = fread(buffer->data + length, 1,
+			   CHUNKSIZE - length % CHUNKSIZE, file);
+		length += lr;
+		if (length % CHUNKSIZE && lr) {
+			continue;
+		}
+		if (length / CHUNKSIZE > buffer->nchunks) {
+			sha256_update(&ctx,
+				      buffer->data +
+				      (size_t)buffer->nchunks * CHUNKSIZE,
+				      CHUNKSIZE);
+			__sync_synchronize();
+			buffer->nchunks++;
+		}
+	} while (lr && length < capacity);
+	if (length == capacity && fgetc(file) != EOF) {
+		ERROR(("buffer_stream: Too much data, stop reading after %d chunks\n", options->maxchunks));
+	}
+	if (length % CHUNKSIZE) {
+		sha256_update(&ctx,
+			      buffer->data + (size_t)buffer->nchunks * CHUNKSIZE,
+			      length % CHUNKSIZE);
+		__sync_synchronize();
+		buffer->nchunks++;
+	}
+	sha256_final(&ctx, buffer->digest);
+	__sync_synchronize();
+	buffer->length = length;
+	buffer->hasdigest = 1;
+	buffer->streaming = 0;
+	if (options->verbose) {
+		do_printf("stream: %u chunks, %u bytes read\n",
+			  buffer->nchunks, buffer->length);
+	}
+	return 1;
+}
+
+/* Copy the sparse map stored after the frames of a carousel */
+static void carousel_sparse(buffer_t * buffer, carousel_t * header)
+{
+	message_t *frames = buffer->frames + header->nchunks;
+
+	buffer->sparse = malloc((header->nchunks + 7) / 8);
+	buffer->sparseframes =
+	    malloc(((size_t)header->nsparseframes + 1) * sizeof(message_t));
+	if (!buffer->sparse || !buffer->sparseframes) {
+		ERROR(("buffer_carousel: Not enough memory"));
+	}
+	memcpy(buffer->sparseframes, frames,
+	       header->nsparseframes * sizeof(message_t));
+	memcpy(buffer->sparse, frames + header->nsparseframes,
+	       (header->nchunks + 7) / 8);
+	buffer->nsparse = header->nsparse;
+	buffer->nsparseframes = header->nsparseframes;
+}
+
+/* Serve a compiled carousel: nothing is read or checksummed, the frames
+ * go out straight from the page cache */
+int buffer_carousel(options_t * options, buffer_t * buffer, char *filename)
+{
+	carousel_t *header;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		ERROR(("buffer_carousel: Unable to open '%s'\n", filename));
+	}
+	if (st.st_size < CAROUSEL_HEADERSIZE) {
+		ERROR(("buffer_carousel: '%s' is not a carousel file\n",
+		       filename));
+	}
+	buffer->carouselsize = st.st_size;
+	buffer->carousel = mmap(NULL, buffer->carouselsize, PROT_READ,
+				MAP_SHARED, fd, 0);
+	close(fd);
+	if (buffer->carousel == MAP_FAILED) {
+		ERROR(("buffer_carousel: Unable to map '%s'\n", filename));
+	}
+	header = buffer->carousel;
+	if (memcmp(header->magic, CAROUSEL_MAGIC, sizeof(header->magic))) {
+		ERROR(("buffer_carousel: '%s' is not a carousel file\n",
+		       filename));
+	}
+	if (header->version != CAROUSEL_VERSION
+	    || header->framesize != sizeof(message_t)) {
+		ERROR(("buffer_carousel: '%s' has version %d and %d bytes frames, expecting %d and %d\n", filename, header->version, header->framesize, CAROUSEL_VERSION, (int)sizeof(message_t)));
+	}
+	if (header->frames < sizeof(carousel_t)
+	    || header->frames + (size_t)header->nchunks * sizeof(message_t) >
+	    buffer->carouselsize
+	    || header->nchunks != (header->length + CHUNKSIZE - 1) / CHUNKSIZE) {
+		ERROR(("buffer_carousel: '%s' is truncated or corrupted\n",
+		       filename));
+	}
+	if (header->nchunks > options->maxchunks) {
+		ERROR(("buffer_carousel: Too much data, '%s' is more than %d chunks\n", filename, options->maxchunks));
+	}
+	if (options->returnvalue && options->returnvalue != header->returnvalue) {
+		ERROR(("buffer_carousel: '%s' was compiled with return value %d\n", filename, header->returnvalue));
+	}
+	if (header->flags & CAROUSEL_SPARSE
+	    && header->frames + ((size_t)header->nchunks +
+				 header->nsparseframes) * sizeof(message_t) +
+	    (header->nchunks + 7) / 8 > buffer->carouselsize) {
+		ERROR(("buffer_carousel: '%s' is truncated or corrupted\n",
+		       filename));
+	}
+	buffer->frames =
+	    (message_t *) ((uint8_t *) buffer->carousel + header->frames);
+	buffer->length = header->length;
+	buffer->nchunks = header->nchunks;
+	buffer->returnvalue = header->returnvalue;
+	memcpy(buffer->digest, header->digest, DIGESTSIZE);
+	buffer->hasdigest = 1;
+	/* the map was found by loopsend -C, taking it saves a scan of the
+	 * whole image on each start. Older files have none */
+	if (options->sparse && header->flags & CAROUSEL_SPARSE) {
+		carousel_sparse(buffer, header);
+	}
+	madvise(buffer->carousel, buffer->carouselsize, MADV_SEQUENTIAL);
+	madvise(buffer->carousel, buffer->carouselsize, MADV_WILLNEED);
+	if (options->verbose) {
+		do_printf("carousel: %u chunks, %u bytes from '%s'\n",
+			  buffer->nchunks, buffer->length, filename);
+	}
+	return 1;
+}
+
+/* Write the image, framed, to a carousel file for loopsend -F. It is
+ * written aside and renamed, a running sender keeps its old mapping. */
+int buffer_compile(options_t * options, buffer_t * buffer, char *filename)
+{
+	uint8_t page[CAROUSEL_HEADERSIZE];
+	carousel_t *header = (carousel_t *) page;
+	message_t message;
+	char *tmp;
+	FILE *file;
+	uint32_t i;
+
+	if (!buffer->hasdigest) {
+		buffer_digest(buffer);
+	}
+	/* the map goes in the file whether -z is used now or not, loopsend
+	 * -F -z then has nothing to scan */
+	if (!buffer->sparse && buffer->nchunks) {
+		buffer_sparse(options, buffer);
+	}
+	memset(page, 0, sizeof(page));
+	memcpy(header->magic, CAROUSEL_MAGIC, sizeof(header->magic));
+	header->version = CAROUSEL_VERSION;
+	header->framesize = sizeof(message_t);
+	header->length = buffer->length;
+	header->nchunks = buffer->nchunks;
+	header->frames = CAROUSEL_HEADERSIZE;
+	header->returnvalue = buffer->returnvalue;
+	memcpy(header->digest, buffer->digest, DIGESTSIZE);
+	if (buffer->sparse) {
+		header->flags |= CAROUSEL_SPARSE;
+		header->nsparse = buffer->nsparse;
+		header->nsparseframes = buffer->nsparseframes;
+	}
+
+	tmp = malloc(strlen(filename) + 5);
+	if (!tmp) {
+		ERROR(("buffer_compile: Not enough memory"));
+	}
+	sprintf(tmp, "%s.tmp", filename);
+	file = fopen(tmp, "w");
+	if (!file) {
+		ERROR(("buffer_compile: Unable to create '%s'\n", tmp));
+	}
+	fwrite(page, 1, sizeof(page), file);
+	for (i = 0; i < buffer->nchunks; i++) {
+		buffer_send(buffer, i, &message);
+		fwrite(&message, 1, sizeof(message), file);
+	}
+	if (buffer->sparse) {
+		fwrite(buffer->sparseframes, sizeof(message_t),
+		       buffer->nsparseframes, file);
+		fwrite(buffer->sparse, 1, (buffer->nchunks + 7) / 8, file);
+	}
+	if (fflush(file) || ferror(file) || fsync(fileno(file))
+	    || fclose(file)) {
+		ERROR(("buffer_compile: Unable to write '%s'\n", tmp));
+	}
+	if (rename(tmp, filename)) {
+		ERROR(("buffer_compile: Unable to rename '%s' to '%s'\n", tmp,
+		       filename));
+	}
+	free(tmp);
+	if (options->verbose) {
+		do_printf("carousel: %u chunks, %u bytes to '%s'\n",
+			  buffer->nchunks, buffer->length, filename);
+	}
+	return 1;
+}
+
+/* fill byte of a chunk made of a single repeated byte, -1 otherwise. The
+ * inner loop has no early exit so that the compiler vectorizes it */
+int chunk_fill(const uint8_t * data)
+{
+	uint64_t pattern = data[0] * 0x0101010101010101ULL, diff, word;
+	int i, j;
+
+	/* frames put the data at odd offsets, memcpy makes the loads safe
+	 * and still compiles to plain unaligned moves */
+	for (i = 0; i < CHUNKSIZE; i += 512) {
+		diff = 0;
+		for (j = i; j < i + 512; j += 8) {
+			memcpy(&word, data + j, 8);
+			diff |= word ^ pattern;
+		}
+		if (diff) {
+			return -1;
+		}
+	}
+	return data[0];
+}
+
+/* Sender: find the runs of uniform chunks and frame the sparse map. The
+ * last chunk is always sent, its tail is not part of the image */
+int buffer_sparse(options_t * options, buffer_t * buffer)
+{
+	sparserun_t run[SPARSERUNS];
+	uint32_t i, nruns = 0, nframes = 0;
+	int fill, last = -1;
+
+	buffer->sparse = malloc((buffer->nchunks + 7) / 8);
+	if (!buffer->sparse) {
+		ERROR(("buffer_sparse: Not enough memory"));
+	}
+	memset(buffer->sparse, 0, (buffer->nchunks + 7) / 8);
+	for (i = 0; i + 1 < buffer->nchunks; i++) {
+		fill = chunk_fill(buffer_chunk(buffer, i));
+		if (fill < 0) {
+			last = -1;
+			continue;
+		}
+		buffer->sparse[i / 8] |= 1 << (i % 8);
+		buffer->nsparse++;
+		if (fill == last) {
+			run[nruns - 1].count++;
+			continue;
+		}
+		if (nruns == SPARSERUNS) {
+			nframes++;
+			buffer->sparseframes =
+			    realloc(buffer->sparseframes,
+				    nframes * sizeof(message_t));
+			if (!buffer->sparseframes) {
+				ERROR(("buffer_sparse: Not enough memory"));
+			}
+			buffer_control(buffer, CONTROL_SPARSE, run,
+				       nruns * sizeof(sparserun_t),
+				       &buffer->sparseframes[nframes - 1]);
+			nruns = 0;
+		}
+		memset(&run[nruns], 0, sizeof(sparserun_t));
+		run[nruns].first = i;
+		run[nruns].count = 1;
+		run[nruns].fill = fill;
+		nruns++;
+		last = fill;
+	}
+	if (nruns) {
+		nframes++;
+		buffer->sparseframes =
+		    realloc(buffer->sparseframes, nframes * sizeof(message_t));
+		if (!buffer->sparseframes) {
+			ERROR(("buffer_sparse: Not enough memory"));
+		}
+		buffer_control(buffer, CONTROL_SPARSE, run,
+			       nruns * sizeof(sparserun_t),
+			       &buffer->sparseframes[nframes - 1]);
+	}
+	buffer->nsparseframes = nframes;
+	if (options->verbose) {
+		do_printf
+		    ("sparse: %u of %u chunks elided, described by %u frames\n",
+		     buffer->nsparse, buffer->nchunks, nframes);
+	}
+	return 1;
+}
+
+int buffer_init(options_t * options, buffer_t * buffer, FILE * file)
+{
+	memset(buffer, 0, sizeof(buffer_t));
+	buffer->maxchunks = options->maxchunks;
+	buffer->returnvalue = options->returnvalue;
+	buffer->journal = options->journal;
+	buffer->journalfd = -1;
+	if (options->sender && options->carousel) {
+		buffer_carousel(options, buffer, options->carousel);
+	} else if (options->sender && options->stream) {
+		/* filled by buffer_stream, while it is being sent */
+		buffer->datasize = (size_t)options->maxchunks * CHUNKSIZE;
+		buffer->data = buffer_arena(options, &buffer->datasize);
+		if (!buffer->data) {
+			ERROR(("buffer_init: Not enough memory"));
+		}
+		buffer->streaming = 1;
+	} else if (file) {
+		buffer_load(options, buffer, file);
+	}
+	if (options->sender && options->sparse && buffer->nchunks
+	    && !buffer->sparse) {
+		buffer_sparse(options, buffer);
+	}
+	/* the receiver's store is only allocated once the first valid
+	 * message tells us the image size, see buffer_alloc */
+	DEBUGP(("buffer_init: Exit\n"));
+	return 1;
+}
+
+int buffer_has(buffer_t * buffer, uint32_t chunk)
+{
+	return buffer->present[chunk / 8] & (1 << (chunk % 8));
+}
+
+int buffer_is_sparse(buffer_t * buffer, uint32_t chunk)
+{
+	return buffer->sparse && (buffer->sparse[chunk / 8] & (1 << (chunk % 8)));
+}
+
+/* receiver: <chunk> is now in the store */
+void buffer_mark(buffer_t * buffer, uint32_t chunk)
+{
+	buffer->present[chunk / 8] |= 1 << (chunk % 8);
+	buffer->received++;
+	while (buffer->contiguous < buffer->nchunks
+	       && buffer_has(buffer, buffer->contiguous)) {
+		buffer->contiguous++;
+	}
+}
+
+/* the slot <s> of the journal file in <journalslot>, 0 if it is not valid */
+int buffer_journal_slot(buffer_t * buffer, int s)
+{
+	journalslot_t *slot = (journalslot_t *) buffer->journalslot;
+	size_t size = sizeof(journalslot_t) + (buffer->maxchunks + 7) / 8;
+	uint32_t crc;
+
+	if (pread(buffer->journalfd, buffer->journalslot, size,
+		  JOURNAL_HEADERSIZE + s * buffer->journalslotsize) != size) {
+		return 0;
+	}
+	crc = slot->crc;
+	slot->crc = 0;
+	return crc32(buffer->journalslot, size) == crc;
+}
+
+/* The bitmap of the previous run is merged once the digests match. The
+ * chunks received meanwhile went to the same place in the file, the same
+ * ones if it is the same image */
+int buffer_journal_check(options_t * options, buffer_t * buffer)
+{
+	uint32_t i, resumed = 0;
+
+	if (!buffer->journaled || !buffer->hasdigest) {
+		return 0;
+	}
+	if (memcmp(buffer->journaldigest, buffer->digest, DIGESTSIZE)) {
+		if (options->verbose) {
+			do_printf("Journal is for another image, starting over\n");
+		}
+		/* zero chunks can't be left as they are in the file */
+		buffer->journalstale = 1;
+	} else {
+		for (i = 0; i < buffer->nchunks; i++) {
+			if (buffer->journaled[i / 8] & (1 << (i % 8))
+			    && !buffer_has(buffer, i)) {
+				buffer_mark(buffer, i);
+				resumed++;
+			}
+		}
+		if (options->verbose) {
+			do_printf
+			    ("Resuming from the journal, %u chunks already here\n",
+			     resumed);
+		}
+	}
+	free(buffer->journaled);
+	buffer->journaled = NULL;
+	return 1;
+}
+
+/* Resumable store: the chunks are mapped from the journal file, at their
+ * place in the image. The bitmap saved is taken back if the file was made
+ * for an image of the same size and the digest was known, otherwise, and
+ * for a streamed image, it starts over */
+int buffer_journal_open(options_t * options, buffer_t * buffer,
+			message_t * message)
+{
+	journalslot_t *slot;
+	journal_t header, found;
+	size_t bitmapsize = (buffer->maxchunks + 7) / 8;
+	uint32_t seq = 0;
+	int s, best = -1;
+
+	buffer->journalslotsize = (sizeof(journalslot_t) + bitmapsize +
+				   JOURNAL_HEADERSIZE - 1) /
+	    JOURNAL_HEADERSIZE * JOURNAL_HEADERSIZE;
+	buffer->journalslot = calloc(1, buffer->journalslotsize);
+	buffer->datasize = (size_t)buffer->maxchunks * CHUNKSIZE;
+	if (!buffer->journalslot) {
+		ERROR(("buffer_journal_open: Not enough memory"));
+	}
+	slot = (journalslot_t *) buffer->journalslot;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.version = JOURNAL_VERSION;
+	header.chunksize = CHUNKSIZE;
+	header.maxchunks = buffer->maxchunks;
+	header.length = message->length;
+	header.nchunks = message->nchunks;
+	header.slotsize = buffer->journalslotsize;
+	header.dataoffset = JOURNAL_HEADERSIZE + 2 * buffer->journalslotsize;
+	header.crc = crc32((uint8_t *) & header, sizeof(header));
+
+	buffer->journalfd = open(buffer->journal, O_RDWR | O_CREAT, 0600);
+	if (buffer->journalfd < 0) {
+		ERROR(("buffer_journal_open: Unable to open '%s'\n",
+		       buffer->journal));
+	}
+	if (message->length
+	    && pread(buffer->journalfd, &found, sizeof(found), 0) ==
+	    sizeof(found) && !memcmp(&found, &header, sizeof(header))) {
+		for (s = 0; s < 2; s++) {
+			if (buffer_journal_slot(buffer, s) && slot->hasdigest
+			    && (best < 0 || slot->seq > seq)) {
+				best = s;
+				seq = slot->seq;
+			}
+		}
+	}
+	if (best >= 0 && buffer_journal_slot(buffer, best)) {
+		buffer->journalseq = slot->seq;
+		buffer->journaled = malloc(bitmapsize);
+		if (!buffer->journaled) {
+			ERROR(("buffer_journal_open: Not enough memory"));
+		}
+		memcpy(buffer->journaled, slot + 1, bitmapsize);
+		memcpy(buffer->journaldigest, slot->digest, DIGESTSIZE);
+	} else if (ftruncate(buffer->journalfd, 0)
+		   || pwrite(buffer->journalfd, &header, sizeof(header), 0) !=
+		   sizeof(header) || fdatasync(buffer->journalfd)) {
+		ERROR(("buffer_journal_open: Unable to write '%s'\n",
+		       buffer->journal));
+	}
+	if (ftruncate(buffer->journalfd, header.dataoffset + buffer->datasize)) {
+		ERROR(("buffer_journal_open: Unable to size '%s'\n",
+		       buffer->journal));
+	}
+#ifndef __KLIBC__
+	/* a full disk is an error now rather than a SIGBUS later */
+	if (message->length
+	    && posix_fallocate(buffer->journalfd, header.dataoffset,
+			       message->length)) {
+		ERROR(("buffer_journal_open: Not enough space for '%s'\n",
+		       buffer->journal));
+	}
+#endif
+	buffer->data = mmap(NULL, buffer->datasize, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, buffer->journalfd, header.dataoffset);
+	if (buffer->data == MAP_FAILED) {
+		buffer->data = NULL;
+		ERROR(("buffer_journal_open: Unable to map '%s'\n",
+		       buffer->journal));
+	}
+	buffer_journal_check(options, buffer);
+	return 1;
+}
+
+/* Save the bitmap. The chunks it lists are written back first, then it
+ * goes to the older slot, whatever is interrupted one of them is valid.
+ * Nothing is saved before the digest tells which image this is, or while
+ * the bitmap of the previous run is not merged */
+int buffer_journal_sync(buffer_t * buffer)
+{
+	journalslot_t *slot = (journalslot_t *) buffer->journalslot;
+	size_t size = sizeof(journalslot_t) + (buffer->maxchunks + 7) / 8;
+
+	if (buffer->journalfd < 0 || buffer->journaled || !buffer->hasdigest
+	    || buffer->received == buffer->journalsynced) {
+		return 0;
+	}
+	if (msync(buffer->data, buffer->datasize, MS_SYNC)) {
+		ERROR(("buffer_journal_sync: Unable to write '%s'\n",
+		       buffer->journal));
+	}
+	memset(slot, 0, sizeof(journalslot_t));
+	slot->seq = ++buffer->journalseq;
+	slot->received = buffer->received;
+	slot->hasdigest = 1;
+	memcpy(slot->digest, buffer->digest, DIGESTSIZE);
+	memcpy(slot + 1, buffer->present, (buffer->maxchunks + 7) / 8);
+	slot->crc = crc32(buffer->journalslot, size);
+	if (pwrite(buffer->journalfd, buffer->journalslot, size,
+		   JOURNAL_HEADERSIZE +
+		   (slot->seq % 2) * buffer->journalslotsize) != size
+	    || fdatasync(buffer->journalfd)) {
+		ERROR(("buffer_journal_sync: Unable to write '%s'\n",
+		       buffer->journal));
+	}
+	buffer->journalsynced = buffer->received;
+	DEBUGP(("buffer_journal_sync: %u chunks\n", buffer->received));
+	return 1;
+}
+
+/* Receiver's store: one bit per chunk, and the payloads in page-aligned
+ * slabs of SLABCHUNKS chunks, mapped on first use, or in the journal file */
+int buffer_alloc(options_t * options, buffer_t * buffer, message_t * message)
+{
+	uint32_t maxslabs = (buffer->maxchunks + SLABCHUNKS - 1) / SLABCHUNKS;
+	uint32_t nchunks = message->nchunks;
+
+	/* sized for <maxchunks>, a streamed image grows up to it */
+	buffer->nslabs = (nchunks + SLABCHUNKS - 1) / SLABCHUNKS;
+	buffer->present = malloc((buffer->maxchunks + 7) / 8);
+	buffer->slabs = malloc(maxslabs * sizeof(uint8_t *));
+	if (!buffer->present || !buffer->slabs) {
+		ERROR(("buffer_alloc: Not enough memory"));
+	}
+	memset(buffer->present, 0, (buffer->maxchunks + 7) / 8);
+	memset(buffer->slabs, 0, maxslabs * sizeof(uint8_t *));
+	buffer->nchunks = nchunks;
+	if (buffer->journal) {
+		buffer_journal_open(options, buffer, message);
+	}
+	DEBUGP(("buffer_alloc: %d chunks, %d slabs\n", nchunks,
+		buffer->nslabs));
+	return 1;
+}
+
+/* Receiver: frames of a streaming sender have a length of 0 and the number
+ * of chunks read so far, the store grows with it and the size is final
+ * with the first frame carrying the length. Returns 0 if <message> does
+ * not fit the image */
+int buffer_grow(buffer_t * buffer, message_t * message)
+{
+	if (!buffer->streaming) {
+		/* provisional frames may still come after the final ones */
+		return !message->length && message->nchunks <= buffer->nchunks;
+	}
+	if (message->nchunks < buffer->nchunks) {
+		return !message->length;
+	}
+	buffer->nchunks = message->nchunks;
+	buffer->nslabs = (buffer->nchunks + SLABCHUNKS - 1) / SLABCHUNKS;
+	while (buffer->contiguous < buffer->nchunks
+	       && buffer_has(buffer, buffer->contiguous)) {
+		buffer->contiguous++;
+	}
+	if (message->length) {
+		buffer->length = message->length;
+		__sync_synchronize();
+		buffer->streaming = 0;
+	}
+	return 1;
+}
+
+uint8_t *buffer_chunk(buffer_t * buffer, uint32_t chunk)
+{
+	uint8_t **slab;
+
+	if (buffer->frames) {
+		return buffer->frames[chunk].chunk.data;
+	}
+	if (buffer->data) {
+		return buffer->data + (size_t)chunk * CHUNKSIZE;
+	}
+	slab = &buffer->slabs[chunk / SLABCHUNKS];
+	if (!*slab) {
+		*slab = mmap(NULL, SLABCHUNKS * CHUNKSIZE,
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (*slab == MAP_FAILED) {
+			ERROR(("buffer_chunk: Not enough memory"));
+		}
+	}
+	return *slab + (chunk % SLABCHUNKS) * CHUNKSIZE;
+}
+
+/* Synthesize the chunks of a sparse map locally. Zero chunks only need
+ * their bit, fresh slabs are zero already and buffer_dump may skip them.
+ * Their slab is still mapped here, the hasher thread reads it and must
+ * not map it concurrently */
+int buffer_recv_sparse(options_t * options, buffer_t * buffer,
+		       message_t * message)
+{
+	control_t *control = (control_t *) message->chunk.data;
+	sparserun_t *run = (sparserun_t *) control->data;
+	uint32_t i, r, nruns;
+
+	nruns = control->length / sizeof(sparserun_t);
+	if (options->exitonvalue || nruns > SPARSERUNS
+	    || message->nchunks > buffer->maxchunks) {
+		return 0;
+	}
+	if (!buffer->present) {
+		buffer_alloc(options, buffer, message);
+	} else if (message->nchunks != buffer->nchunks) {
+		return 0;
+	}
+	if (!buffer->sparse) {
+		buffer->sparse = malloc((buffer->nchunks + 7) / 8);
+		if (!buffer->sparse) {
+			ERROR(("buffer_recv_sparse: Not enough memory"));
+		}
+		memset(buffer->sparse, 0, (buffer->nchunks + 7) / 8);
+	}
+	buffer->length = message->length;
+	for (r = 0; r < nruns; r++, run++) {
+		if (run->first >= buffer->nchunks
+		    || run->count > buffer->nchunks - run->first) {
+			return 0;
+		}
+		for (i = run->first; i < run->first + run->count; i++) {
+			if (buffer_has(buffer, i)) {
+				continue;
+			}
+			/* an old journal still being checked may hold
+			 * another image's bytes there */
+			if (run->fill || buffer->journalstale
+			    || buffer->journaled) {
+				memset(buffer_chunk(buffer, i), run->fill,
+				       CHUNKSIZE);
+			} else {
+				buffer_chunk(buffer, i);
+				buffer->sparse[i / 8] |= 1 << (i % 8);
+				buffer->nsparse++;
+			}
+			buffer_mark(buffer, i);
 		}
 	}
+	DEBUGP(("buffer_recv_sparse: %d runs\n", nruns));
+	return 3;
+}
+
+/* Returns 3 for a control frame that was understood, 0 if it was ignored */
+int buffer_recv_control(options_t * options, buffer_t * buffer,
+			message_t * message)
+{
+	control_t *control = (control_t *) message->chunk.data;
+	int i;
+
+	trace(TRACE_CONTROL, control->type);
+	switch (control->type) {
+	case CONTROL_DIGEST:
+		if (control->length != DIGESTSIZE || buffer->hasdigest) {
+			return 0;
+		}
+		memcpy(buffer->digest, control->data, DIGESTSIZE);
+		buffer->hasdigest = 1;
+		if (options->verbose) {
+			do_printf("Image digest: ");
+			for (i = 0; i < DIGESTSIZE; i++) {
+				do_printf("%02x", buffer->digest[i]);
+			}
+			do_printf("\n");
+		}
+		buffer_journal_check(options, buffer);
+		return 3;
+	case CONTROL_SPARSE:
+		return buffer_recv_sparse(options, buffer, message);
+	case CONTROL_REPAIR:
+		/* the carousel stopped, missing chunks are to be asked for.
+		 * With -R no chunk comes anymore, the return value is taken
+		 * from this frame */
+		if (options->exitonvalue) {
+			buffer->returnvalue = message->chunk.returnvalue;
+			buffer->repairing = 1;
+			return 3;
+		}
+		if (message->nchunks > buffer->maxchunks) {
+			return 0;
+		}
+		if (!buffer->present) {
+			buffer_alloc(options, buffer, message);
+			buffer->length = message->length;
+		}
+		buffer->repairing = 1;
+		return 3;
+	}
+	DEBUGP(("buffer_recv_control: unknown control type %d\n",
+		control->type));
+	return 0;
+}
+
+int buffer_recv(options_t * options, buffer_t * buffer, message_t * message)
+{
+	uint32_t crc, crcmsg, n;
+
+	n = message->chunk.n;
+	/* while streaming, headers are checked for the final size */
+	if (n > 0 && n <= buffer->nchunks && buffer_has(buffer, n - 1)
+	    && !buffer->streaming) {
+		DEBUGP(("buffer_recv: chunk %d already here\n", n));
+		trace(TRACE_DUP, n);
+		return 2;
+	}
 	crcmsg = message->crc;
 	message->crc = 0;
 	crc = crc32((uint8_t *) message, sizeof(message_t));
 	if (crc == crcmsg) {
-		if (message->chunk.n < 1
-		    || message->chunk.n > buffer->maxchunks) {
+		if (!n) {
+			return buffer_recv_control(options, buffer, message);
+		}
+		if (n > message->nchunks
+		    || message->nchunks > buffer->maxchunks) {
 			ERROR(("buffer_recv: Unexpected chunk number"));
 		}
-		if ((message->chunk.n < buffer->last_chunk_number)) {
+		buffer->returnvalue = message->chunk.returnvalue;
+		if (options->exitonvalue) {
+			/* only the return value is wanted, keep the
+			 * store untouched */
+			return 1;
+		}
+		if (!buffer->present) {
+			buffer_alloc(options, buffer, message);
+			buffer->streaming = !message->length;
+		} else if ((buffer->streaming
+			    || message->nchunks != buffer->nchunks)
+			   && !buffer_grow(buffer, message)) {
+			DEBUGP(("buffer_recv: Exit (image size changed)\n"));
+			return 0;
+		}
+		if (buffer_has(buffer, n - 1)) {
+			trace(TRACE_DUP, n);
+			return 2;
+		}
+		/* layers interleave chunks from all over the image */
+		if (n < buffer->last_chunk_number && !buffer->repairing
+		    && options->layers < 2) {
 			if (options->verbose) {
 				do_printf
 				    ("Entering a new receive loop from sender\n");
 			}
 		}
-		buffer->length = message->length;
-		buffer->nchunks = message->nchunks;
-		buffer->chunks[message->chunk.n - 1] = message->chunk;
-		DEBUGP(("buffer_recv: Exit (chunk %ld ok)\n",
-			message->chunk.n));
+		buffer->last_chunk_number = n;
+		if (message->length) {
+			buffer->length = message->length;
+		}
+		memcpy(buffer_chunk(buffer, n - 1), message->chunk.data,
+		       CHUNKSIZE);
+		buffer_mark(buffer, n - 1);
+		trace(TRACE_RECV, n);
+		DEBUGP(("buffer_recv: Exit (chunk %ld ok)\n", n));
 		return 1;
 	}
 	DEBUGP(("buffer_recv: Exit (message failed)\n"));
+	trace(TRACE_CRCFAIL, n);
 	return 0;
 }
 
 int buffer_send(buffer_t * buffer, uint32_t chunk, message_t * message)
 {
-	uint32_t crc;
+	uint32_t crc, offset, len;
 
+	offset = chunk * CHUNKSIZE;
+	len = buffer->length - offset;
+	/* a length of 0 is a streaming sender's, chunks so far are whole */
+	if (len > CHUNKSIZE || !buffer->length) {
+		len = CHUNKSIZE;
+	}
 	message->crc = 0;
 	message->length = buffer->length;
+	/* streaming: <nchunks> is final once the length is set */
+	__sync_synchronize();
 	message->nchunks = buffer->nchunks;
-	message->chunk = buffer->chunks[chunk];
+	message->chunk.n = chunk + 1;
+	message->chunk.returnvalue = buffer->returnvalue;
+	memcpy(message->chunk.data, buffer_chunk(buffer, chunk), len);
+	/* zero the tail of the last chunk and the structure padding */
+	memset(message->chunk.data + len, 0,
+	       (uint8_t *) (message + 1) - (message->chunk.data + len));
 	crc = crc32((uint8_t *) message, sizeof(message_t));
 	message->crc = crc;
 	DEBUGP(("buffer_send: Exit\n"));
 	return 1;
 }
 
-int buffer_dump(buffer_t * buffer, FILE * file)
+int buffer_control(buffer_t * buffer, uint8_t type, void *data,
+		   uint16_t length, message_t * message)
 {
-	uint32_t length;
-	uint16_t i;
+	control_t *control = (control_t *) message->chunk.data;
+	uint32_t crc;
 
-	length = 0;
-	for (i = 0; i < buffer->nchunks; i++) {
-		if (!buffer->chunks[i].n) {
-			DEBUGP(("buffer_dump: Exit (buffer not ready)\n"));
-			return 0;
+	memset(message, 0, sizeof(message_t));
+	message->length = buffer->length;
+	message->nchunks = buffer->nchunks;
+	message->chunk.returnvalue = buffer->returnvalue;
+	control->type = type;
+	control->length = length;
+	memcpy(control->data, data, length);
+	crc = crc32((uint8_t *) message, sizeof(message_t));
+	message->crc = crc;
+	return 1;
+}
+
+/* feed the image bytes of chunks [from, to) to <ctx> */
+int buffer_hash(buffer_t * buffer, sha256_t * ctx, uint32_t from, uint32_t to)
+{
+	size_t len;
+
+	for (; from < to; from++) {
+		len = buffer->length - (size_t)from * CHUNKSIZE;
+		if (len > CHUNKSIZE || !buffer->length) {
+			len = CHUNKSIZE;
 		}
-		length += CHUNKSIZE;
+		sha256_update(ctx, buffer_chunk(buffer, from), len);
+	}
+	return 1;
+}
+
+/* sender: digest of the whole image, published once it is complete */
+int buffer_digest(buffer_t * buffer)
+{
+	sha256_t ctx;
+
+	sha256_init(&ctx);
+	buffer_hash(buffer, &ctx, 0, buffer->nchunks);
+	sha256_final(&ctx, buffer->digest);
+	__sync_synchronize();
+	buffer->hasdigest = 1;
+	return 1;
+}
+
+/* the framed message for <chunk>: straight from the carousel file, or
+ * built into <message> */
+message_t *buffer_frame(buffer_t * buffer, uint32_t chunk,
+			message_t * message)
+{
+	if (buffer->frames) {
+		return &buffer->frames[chunk];
+	}
+	buffer_send(buffer, chunk, message);
+	return message;
+}
+
+/* Zero chunks are seeked over when the image is written at the end of a
+ * regular file, they read back as zero. Returns 0 if <file> can't have
+ * holes (pipe, block device, existing data) */
+int buffer_dump_holes(buffer_t * buffer, FILE * file)
+{
+	struct stat st;
+	off_t start;
+	uint32_t i, length;
+	int fd;
+
+	fd = fileno(file);
+	fflush(file);
+	start = lseek(fd, 0, SEEK_CUR);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || start != st.st_size) {
+		return 0;
 	}
-	length = 0;
 	for (i = 0; i < buffer->nchunks; i++) {
-		length += CHUNKSIZE;
-		if (length > buffer->length) {
-			fwrite(buffer->chunks[i].data, 1,
-			       CHUNKSIZE - length + buffer->length, file);
+		length = buffer->length - i * CHUNKSIZE;
+		if (length > CHUNKSIZE) {
+			length = CHUNKSIZE;
+		}
+		if (buffer_is_sparse(buffer, i)) {
+			fseek(file, length, SEEK_CUR);
 		} else {
-			fwrite(buffer->chunks[i].data, 1, CHUNKSIZE, file);
+			fwrite(buffer_chunk(buffer, i), 1, length, file);
+		}
+	}
+	fflush(file);
+	if (ftruncate(fd, start + buffer->length)) {
+		ERROR(("buffer_dump: Unable to set the image size"));
+	}
+	DEBUGP(("buffer_dump_holes: %d chunks left as holes\n",
+		buffer->nsparse));
+	return 1;
+}
+
+int buffer_dump(buffer_t * buffer, FILE * file)
+{
+	uint32_t i, length;
+
+	if (!buffer->present || buffer->received < buffer->nchunks
+	    || buffer->streaming) {
+		DEBUGP(("buffer_dump: Exit (buffer not ready)\n"));
+		return 0;
+	}
+	if (buffer->nsparse && buffer_dump_holes(buffer, file)) {
+		return 1;
+	}
+	for (i = 0; i < buffer->nslabs; i++) {
+		length = buffer->length - i * SLABCHUNKS * CHUNKSIZE;
+		if (length > SLABCHUNKS * CHUNKSIZE) {
+			length = SLABCHUNKS * CHUNKSIZE;
 		}
+		fwrite(buffer_chunk(buffer, i * SLABCHUNKS), 1, length, file);
 	}
 
 	DEBUGP(("buffer_dump: Exit (buffer dumped, %ld)\n", buffer->length));
@@ -812,9 +3768,45 @@ int buffer_dump(buffer_t * buffer, FILE * file)
 
 int buffer_clean(buffer_t * buffer)
 {
-	if (buffer->chunks) {
-		free(buffer->chunks);
-		buffer->chunks = NULL;
+	uint32_t i;
+
+	free(buffer->sparse);
+	free(buffer->sparseframes);
+	buffer->sparse = NULL;
+	buffer->sparseframes = NULL;
+	if (buffer->carousel) {
+		munmap(buffer->carousel, buffer->carouselsize);
+		buffer->carousel = NULL;
+		buffer->frames = NULL;
+		return 1;
+	}
+	if (buffer->journalfd >= 0) {
+		close(buffer->journalfd);
+		buffer->journalfd = -1;
+	}
+	free(buffer->journaled);
+	free(buffer->journalslot);
+	buffer->journaled = NULL;
+	buffer->journalslot = NULL;
+	if (buffer->data) {
+		munmap(buffer->data, buffer->datasize);
+		buffer->data = NULL;
+		/* the receiver's journal, its bitmap is still to be freed */
+		if (!buffer->present) {
+			return 1;
+		}
+	}
+	if (buffer->present) {
+		for (i = 0; i < buffer->nslabs; i++) {
+			if (buffer->slabs[i]) {
+				munmap(buffer->slabs[i],
+				       SLABCHUNKS * CHUNKSIZE);
+			}
+		}
+		free(buffer->slabs);
+		free(buffer->present);
+		buffer->slabs = NULL;
+		buffer->present = NULL;
 		return 1;
 	}
 	return 0;
@@ -23,6 +23,7 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -31,13 +32,84 @@
 #include <linux/if.h>
 
 #define CHUNKSIZE 4096
+#define SLABCHUNKS 256
 #define MAXWAIT 5
+#define HUGEPAGESIZE (2 * 1024 * 1024)
 
 #define IP_ADDR	"239.0.0.1"
 #define IP_PORT 2121
 #define RECEIVER 0
 #define SENDER 1
 #define STATUSCMD_LENGTH 256
+#define MAXINTERFACES 8
+#define MAXLAYERS 8
+#define LAYERINTERVAL 500
+#define LAYERLOSS 5
+#define LAYERJOIN 1000
+#define LAYERMAXJOIN 30000
+#define LAYERSETTLE 2000
+#define MAXEVENTS 32
+#define MAXCPUS (MAXINTERFACES * MAXLAYERS)
+#define BUSYWAIT 50000
+#define EVENT_FD 0
+#define EVENT_TIMER 1
+#define EVENT_SIGNAL 2
+#define HUGEPAGES_TRANSPARENT 1
+#define HUGEPAGES_EXPLICIT 2
+#define DIGESTSIZE 32
+#define CONTROL_DIGEST 1
+#define CONTROL_SPARSE 2
+#define CONTROL_REPAIR 3
+#define REPAIR_MAGIC 0x4c435251
+#define REPAIRRANGES 64
+#define REPAIRBUDGET 256
+#define REPAIRINTERVAL 100
+#define PEERINTERVAL 100
+#define PEERBACKOFF 20
+#define PEERLINGER 5
+#define MAXPEERS 32
+#define PEERTIMEOUT 2
+#define ANNOUNCE_MAGIC 0x4c435052
+#define COMMAND_MAGIC 0x4c43434d
+#define ACK_MAGIC 0x4c43414b
+#define COMMANDBACKOFF 10
+#define COMMANDMAXBACKOFF 1000
+#define COMMANDWINDOW 60
+#define KEYSIZE 64
+#define FEEDBACKREPORTS 16
+#define PROBABILITY_ONE 65536
+#define CAROUSEL_MAGIC "LOOPCAST"
+#define CAROUSEL_VERSION 1
+#define CAROUSEL_HEADERSIZE 4096
+#define CAPTURE_MAGIC "LCCAPTR1"
+#define CAPTUREBUFFER (1024 * 1024)
+#define JOURNAL_MAGIC "LCJOURNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADERSIZE 4096
+#define JOURNALINTERVAL 1000
+
+#define TRACESIZE 4096
+#define MAXTRACERINGS (MAXINTERFACES * MAXLAYERS + 4)
+#define TRACE_MAGIC "LCTRACE1"
+
+// flight recorder events, <arg> in comment
+#define TRACE_RECV 1		/* chunk accepted, chunk number */
+#define TRACE_DUP 2		/* chunk already here, chunk number */
+#define TRACE_CRCFAIL 3		/* bad crc, chunk number as received */
+#define TRACE_CONTROL 4		/* control frame, type */
+#define TRACE_SEND 5		/* message sent, chunk number, 0 for control */
+#define TRACE_PACE 6		/* pacing wait, ns */
+#define TRACE_KEEPALIVE_SEND 7	/* keepalive sent, client id */
+#define TRACE_KEEPALIVE_RECV 8	/* keepalive received, client id */
+#define TRACE_LOOP 9		/* sender loop done, loop number */
+#define TRACE_DONE 10		/* image complete, chunks */
+#define TRACE_REPAIR 11		/* unicast repair, chunks requested or sent */
+
+#ifdef __KLIBC__
+#define TRACE_TLS
+#else
+#define TRACE_TLS __thread
+#endif
 
 #define ERROR(x) { debug_printf x; exit (1); }
 
@@ -54,18 +126,73 @@ typedef struct options_s {
 	int verbose;
 	int maxwait;
 	int clientsnumber;
-	struct itimerval maxwait_itimer;
 	int bwlimit;
-	struct itimerval bwlimit_itimer;
 	int keepalives;
 	char statuscmd[STATUSCMD_LENGTH + 1];
 	int statusstep;
 	unsigned short int ip_port;
 	unsigned long int ip_addr;
 	char interface[IFNAMSIZ];
+	/* sender: one transmit worker per interface, with its own limit */
+	int ninterfaces;
+	struct egress_s {
+		char interface[IFNAMSIZ];
+		int bwlimit;
+	} egress[MAXINTERFACES];
 	char *output;
 	uint8_t returnvalue;
 	int exitonvalue;
+	int verifydigest;
+	/* sender: publish the image digest on the group, older receivers
+	 * exit on these control frames */
+	int senddigest;
+	int hugepages;
+	int sparse;
+	/* cooperative senders: this one is <peerindex> of <npeers> */
+	int peerindex;
+	int npeers;
+	/* sender: unicast repair once this % of the clients are done */
+	int repair;
+	/* command mode: only the return value is sent, HMAC signed with
+	 * <key> if set */
+	int command;
+	/* sender: send chunks as they are read from stdin */
+	int stream;
+	/* sender: keep the image and serve waves of clients, idle between
+	 * them */
+	int daemon;
+	/* sender: low-jitter transmit, workers pinned to these cpus, at this
+	 * SCHED_FIFO priority, and spinning on the clock for the last
+	 * BUSYWAIT ns of each gap */
+	int ncpus;
+	int cpus[MAXCPUS];
+	int rtprio;
+	int busywait;
+	/* receiver: SO_BUSY_POLL on the data sockets, in us */
+	int busypoll;
+	/* receiver: re-multicast through <interface>[:<bwlimit>] */
+	char *relay;
+	/* receiver: ask the other receivers for missing chunks, and answer
+	 * their requests */
+	int peerrepair;
+	/* layered multicast: layer <l> goes to the group + <l>, at the
+	 * bandwidth limit times 2^(l-1) */
+	int layers;
+	/* receiver: scalable keepalives, randomized, sampled and suppressed
+	 * by what the other receivers send */
+	int feedback;
+	/* receiver: resumable store, chunks and their bitmap are kept in
+	 * this file across restarts */
+	char *journal;
+	/* receiver: datagrams received are recorded to this file, see
+	 * loopreplay */
+	char *capture;
+	uint8_t key[KEYSIZE];
+	int keylength;
+	char *compile;
+	char *carousel;
+	char *tracefile;
+	struct transport_s *transport;
 } options_t;
 
 // network data
@@ -75,22 +202,135 @@ typedef struct netsock_s {
 	struct ip_mreq imreq;
 	struct in_addr iaddr;
 	struct ifreq interface;
+	/* receiver, capturing: kernel receive time of the last datagram, in
+	 * ns since the epoch, 0 if unknown */
+	uint64_t stamp;
 } netsock_t;
 
 typedef struct network_s {
 	int percent;
+	int progressfd;
+	pid_t progresspid;
 	uint32_t id;
 	long received_packets;
 	struct netsock_s data;
+	struct netsock_s *egress[MAXINTERFACES];
+	int negress;
+	/* layered multicast. Sender: layer <l> of egress <i>, the first
+	 * layer is the egress itself. Receiver: layer <l> of the only one */
+	struct netsock_s *layer[MAXLAYERS][MAXINTERFACES];
 	struct netsock_s keepalive;
 	struct keepalive_s *keepalives;
+	/* cooperative senders: announcements go to the keepalive port */
+	struct netsock_s announce;
+	time_t peers[MAXPEERS];
+	volatile uint32_t peers_alive;
+	uint32_t length;
+	uint32_t nchunks;
+	/* receiver: completion % sent with keepalives, and where unicast
+	 * repair requests go. Sender: where they come from */
+	uint8_t completion;
+	struct netsock_s repair;
+	volatile int repairing;
+	/* receiver: peer repair requests are heard on <port+3>, ours go to
+	 * the group there and the answers to the data port, not routed */
+	struct netsock_s peerrecv;
+	struct netsock_s peernack;
+	struct netsock_s peerdata;
+	/* command mode: sequence number sent, and acknowledgements */
+	uint32_t seq;
+	int acks;
+	/* scalable feedback. Receiver: the keepalive port is listened to,
+	 * <heard> is the weight of the reports since our last keepalive, and
+	 * ours are sent with <probability>/PROBABILITY_ONE. Sender: weight
+	 * of the reports since <heardsince>, and the clients it stands for */
+	struct netsock_s feedback;
+	uint32_t probability;
+	int suppressed;
+	double heard;
+	time_t heardsince;
+	uint32_t fleet;
+	/* receiver: capture file (-W), times are from <capturerealtime> for
+	 * datagrams with a kernel timestamp, from <capturens> otherwise */
+	FILE *capture;
+	uint64_t capturens;
+	uint64_t capturerealtime;
+	struct transport_s *transport;
+	void *transport_data;
 } network_t;
 
+// how datagrams are moved, udp sockets unless options->transport is set
+typedef struct transport_s {
+	int (*init) (options_t * options, network_t * network);
+	int (*send) (network_t * network, netsock_t * sock, void *data,
+		     int len);
+	int (*recv) (network_t * network, netsock_t * sock, void *data,
+		     int len);
+	time_t (*time) (network_t * network);
+	int (*clean) (network_t * network);
+} transport_t;
+
+// sent by cooperative senders to the keepalive port, told apart by its size
+typedef struct announce_s {
+	uint32_t magic;
+	uint16_t index;
+	uint16_t count;
+	uint32_t length;
+	uint32_t nchunks;
+} announce_t;
+
 typedef struct keepalive_s {
 	time_t time;
 	uint8_t value;
+	uint8_t completion;
+	uint8_t seen;
+	uint8_t acked;
 } keepalive_t;
 
+/* Command mode: sent instead of messages, repeated with backoff. <crc>
+ * is computed with itself zeroed, <mac> (if <hmac>) is the HMAC-SHA256 of
+ * the fields before <crc>. Integers in network order */
+typedef struct command_s {
+	uint32_t magic;
+	uint32_t seq;
+	/* sender's clock at this send, a signed command more than
+	 * COMMANDWINDOW seconds away from the receiver's is a replay */
+	uint32_t time;
+	uint8_t returnvalue;
+	uint8_t hmac;
+	uint8_t reserved[2];
+	uint32_t crc;
+	uint8_t mac[DIGESTSIZE];
+} command_t;
+
+/* sampled keepalive (-f on the receiver), to the keepalive port. <weight>
+ * is in client-milliseconds: the mean keepalive period of the receiver over
+ * the probability it reported with, the sum of the weights heard divided by
+ * the time they were heard during is the size of the fleet */
+typedef struct report_s {
+	uint32_t id;
+	uint32_t weight;
+} report_t;
+
+// command acknowledgement, to the keepalive port: client id, with value
+typedef struct ack_s {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t seq;
+} ack_t;
+
+// unicast repair request, to the sender's port+2: missing chunk ranges.
+// Also the peer repair request, to the group's port+3
+typedef struct repair_s {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t nranges;
+	struct {
+		uint32_t first;
+		uint32_t count;
+	} ranges[REPAIRRANGES];
+} repair_t;
+
 // elementary chunk of transfered data
 typedef struct chunk_s {
 	uint16_t n;
@@ -104,7 +344,49 @@ typedef struct buffer_s {
 	uint32_t maxchunks;
 	uint32_t nchunks;
 	uint32_t last_chunk_number;
-	chunk_t *chunks;
+	uint32_t received;
+	uint32_t contiguous;
+	uint8_t returnvalue;
+	/* chunks made of a single repeated byte are not sent, but described
+	 * by run-length control frames. Sender: bit set for each elided chunk.
+	 * Receiver: bit set for each chunk known to be zero */
+	uint8_t *sparse;
+	uint32_t nsparse;
+	struct message_s *sparseframes;
+	uint32_t nsparseframes;
+	/* whole image sha256, published by the sender in control frames */
+	uint8_t digest[DIGESTSIZE];
+	volatile int hasdigest;
+	/* receiver: the sender switched to unicast repair */
+	int repairing;
+	/* Sender: stdin is still being read, <nchunks> chunks so far and
+	 * <length> is 0. Receiver: <nchunks> is still provisional */
+	volatile int streaming;
+	/* receiver side: received chunks bitmap and payload slabs */
+	uint8_t *present;
+	uint8_t **slabs;
+	uint32_t nslabs;
+	/* sender side: the image itself, mapped from the input file or
+	 * read into an anonymous arena */
+	uint8_t *data;
+	size_t datasize;
+	int mapped;
+	/* sender side: pre-framed messages served from a carousel file */
+	struct message_s *frames;
+	void *carousel;
+	size_t carouselsize;
+	/* receiver: resumable store (-j), <data> is mapped from the journal
+	 * file. <journaled> is the bitmap of the previous run, merged once
+	 * the digest shows it is the same image */
+	char *journal;
+	int journalfd;
+	uint32_t journalseq;
+	uint32_t journalsynced;
+	int journalstale;
+	uint8_t *journaled;
+	uint8_t journaldigest[DIGESTSIZE];
+	uint8_t *journalslot;
+	size_t journalslotsize;
 } buffer_t;
 
 // we transfer a chunk with its header
@@ -115,30 +397,284 @@ typedef struct message_s {
 	chunk_t chunk;
 } message_t;
 
+// control frames are messages with chunk.n == 0, chunk.data holds a control_t
+typedef struct control_s {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t length;
+	uint8_t data[CHUNKSIZE - 4];
+} control_t;
+
+// CONTROL_SPARSE payload: <count> chunks from <first> are filled with <fill>
+typedef struct sparserun_s {
+	uint32_t first;
+	uint32_t count;
+	uint8_t fill;
+	uint8_t reserved[3];
+} sparserun_t;
+
+#define SPARSERUNS ((CHUNKSIZE - 4) / sizeof(sparserun_t))
+
+/* Carousel file (loopsend -C), served as is by loopsend -F: this header,
+ * padded to CAROUSEL_HEADERSIZE, then <nchunks> ready to send messages of
+ * <framesize> bytes. With CAROUSEL_SPARSE, the <nsparseframes> frames of
+ * the sparse map follow, then its bitmap. Integers are in host order, like
+ * on the wire. */
+typedef struct carousel_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t framesize;
+	uint32_t length;
+	uint32_t nchunks;
+	uint32_t frames;
+	uint8_t returnvalue;
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint8_t digest[DIGESTSIZE];
+	uint32_t nsparse;
+	uint32_t nsparseframes;
+} carousel_t;
+
+#define CAROUSEL_SPARSE 1
+
+/* Journal file (looprecv -j): this header, padded to JOURNAL_HEADERSIZE,
+ * two slots of <slotsize> bytes, then the chunks at <dataoffset>, each at
+ * its place in the image. A slot is a journalslot_t followed by the
+ * bitmap of the chunks received, for <maxchunks> chunks. Slots are
+ * written in turn, once the chunks they list are on disk, the valid one
+ * with the highest <seq> is the current one. <crc> are computed with
+ * themselves zeroed, over the bitmap too for a slot. Host order */
+typedef struct journal_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunksize;
+	uint32_t maxchunks;
+	uint32_t length;
+	uint32_t nchunks;
+	uint32_t slotsize;
+	uint64_t dataoffset;
+	uint32_t crc;
+	uint32_t reserved;
+} journal_t;
+
+typedef struct journalslot_s {
+	uint32_t seq;
+	uint32_t received;
+	uint8_t hasdigest;
+	uint8_t reserved[3];
+	uint8_t digest[DIGESTSIZE];
+	uint32_t crc;
+} journalslot_t;
+
+/* Capture file (looprecv -W): this header, then each datagram read from the
+ * data sockets as a capturerecord_t followed by its <length> bytes. <time>
+ * is in ns from the start of the capture, <realtime> is that start in ns
+ * since the epoch. Host order */
+typedef struct capture_s {
+	char magic[8];
+	uint32_t framesize;
+	uint32_t maxchunks;
+	uint64_t realtime;
+} capture_t;
+
+typedef struct capturerecord_s {
+	uint64_t time;
+	uint16_t length;
+	uint8_t layer;
+	uint8_t reserved[5];
+} capturerecord_t;
+
+typedef struct sha256_s {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t block[64];
+} sha256_t;
+
+/* Flight recorder: each thread writes compact events in its own ring,
+ * without locks, and the rings are dumped to a file (see looptrace) */
+typedef struct trace_event_s {
+	uint64_t time;
+	uint32_t arg;
+	uint16_t type;
+	uint16_t reserved;
+} trace_event_t;
+
+typedef struct tracering_s {
+	char name[16];
+	uint32_t head;
+	uint32_t reserved;
+	trace_event_t events[TRACESIZE];
+} tracering_t;
+
+// trace file: this header, then <nrings> tracering_t
+typedef struct tracefile_s {
+	char magic[8];
+	uint32_t nrings;
+	uint32_t tsc;
+	uint64_t clock0, ns0;
+	uint64_t clock1, ns1;
+} tracefile_t;
+
+extern TRACE_TLS tracering_t *trace_ring;
+
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc":"=a"(lo), "=d"(hi));
+	return (uint64_t) hi << 32 | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace(uint16_t type, uint32_t arg)
+{
+	tracering_t *ring = trace_ring;
+	trace_event_t *event;
+
+	if (!ring) {
+		return;
+	}
+	event = &ring->events[ring->head++ & (TRACESIZE - 1)];
+	event->time = trace_clock();
+	event->arg = arg;
+	event->type = type;
+}
+
+// event loop
+struct evloop_s;
+typedef struct event_s {
+	int type;
+	int fd;
+	int signo;
+	long interval;
+#ifdef __KLIBC__
+	long next;
+#endif
+	int (*handler) (struct evloop_s * loop, struct event_s * event);
+	void *data;
+} event_t;
+
+typedef int (*event_handler_t) (struct evloop_s * loop, event_t * event);
+
+typedef struct evloop_s {
+	int fd;
+	int stop;
+	int nevents;
+	event_t *events[MAXEVENTS];
+} evloop_t;
+
 // basic 
 int debug_printf(const char *fmt, ...);
 uint32_t crc32(uint8_t * data, int len);
+void sha256_init(sha256_t * ctx);
+void sha256_update(sha256_t * ctx, const uint8_t * data, size_t len);
+void sha256_final(sha256_t * ctx, uint8_t * digest);
+void hmac_sha256(const uint8_t * key, int keylength, const uint8_t * data,
+		 size_t length, uint8_t * mac);
 
 // print to stderr
 int do_printf(const char *fmt, ...);
 
+// flight recorder, dumped at exit to <filename> if set
+int trace_init(options_t * options);
+int trace_thread(const char *name);
+int trace_dump(const char *filename);
+uint64_t trace_ns(void);
+
 // parse the command line
 int options_init(options_t * options, int sender, int argc, char **argv);
+int interfaces_init(options_t * options, char *arg);
+int cpus_init(options_t * options, char *arg);
 
 // manage communication 
+extern transport_t udp_transport;
 int network_init(options_t * options, network_t * network);
+time_t network_time(network_t * network);
 int network_send(network_t * network, message_t * message);
+int network_send_egress(network_t * network, int egress, message_t * message);
 int network_recv(options_t * options, network_t * network, message_t * message);
+int network_send_layer(network_t * network, int egress, int layer,
+		       message_t * message);
+int network_recv_layer(options_t * options, network_t * network, int layer,
+		       message_t * message);
+int network_join_layer(options_t * options, network_t * network, int layer,
+		       int join);
+int chunk_layer(options_t * options, uint32_t chunk, uint32_t loop);
 int network_send_keepalive(network_t * network);
 int network_recv_keepalives(options_t * options, network_t * network,
 			    time_t starttime);
 int network_dump_keepalives(options_t * options, network_t * network);
+int network_clients(network_t * network, int *done);
+int network_send_report(network_t * network, uint32_t weight);
+int network_recv_feedback(options_t * options, network_t * network);
+long network_send_feedback(options_t * options, network_t * network,
+			   long elapsed);
+uint32_t network_fleet(options_t * options, network_t * network);
+int network_send_command(options_t * options, network_t * network,
+			 uint8_t returnvalue);
+int network_check_command(options_t * options, network_t * network,
+			  command_t * command);
+int network_send_ack(network_t * network, uint32_t seq, uint8_t value);
+int network_dump_acks(options_t * options, network_t * network);
+int network_repair_init(options_t * options, network_t * network);
+int network_send_repair(network_t * network, buffer_t * buffer);
+int network_send_nack(network_t * network, buffer_t * buffer,
+		      uint8_t * requested, uint32_t upto);
+int network_recv_nack(network_t * network, repair_t * request);
+int network_send_peer(network_t * network, message_t * message);
+int network_serve_repair(options_t * options, network_t * network,
+			 buffer_t * buffer);
+int network_announce(options_t * options, network_t * network,
+		     buffer_t * buffer);
+uint32_t network_peers(options_t * options, network_t * network,
+		       time_t starttime);
+int network_peer_owner(options_t * options, network_t * network,
+		       uint32_t chunk);
 int network_clean(network_t * network);
 
+// event loop, <interval> and <timeout> are in ms
+int evloop_init(evloop_t * loop);
+int event_fd(evloop_t * loop, event_t * event, int fd,
+	     event_handler_t handler, void *data);
+int event_timer(evloop_t * loop, event_t * event, long interval,
+		event_handler_t handler, void *data);
+int event_timer_set(event_t * event, long interval);
+int event_signals(evloop_t * loop, event_t * event, sigset_t * set,
+		  event_handler_t handler, void *data);
+int evloop_run(evloop_t * loop, int timeout);
+int evloop_clean(evloop_t * loop);
+
+// report transfer progress to the status command (-x, -s)
+int progress_init(options_t * options, network_t * network);
+void progress_report(network_t * network, int percent);
+void progress_update(options_t * options, network_t * network,
+		     buffer_t * buffer);
+int progress_clean(network_t * network);
+
 // manage buffer
 int buffer_init(options_t * options, buffer_t * buffer, FILE * file);
+int buffer_alloc(options_t * options, buffer_t * buffer, message_t * message);
+int buffer_has(buffer_t * buffer, uint32_t chunk);
+int buffer_is_sparse(buffer_t * buffer, uint32_t chunk);
+int buffer_sparse(options_t * options, buffer_t * buffer);
+uint8_t *buffer_chunk(buffer_t * buffer, uint32_t chunk);
 int buffer_send(buffer_t * buffer, uint32_t chunk, message_t * message);
+message_t *buffer_frame(buffer_t * buffer, uint32_t chunk,
+			message_t * message);
+int buffer_compile(options_t * options, buffer_t * buffer, char *filename);
+int buffer_stream(options_t * options, buffer_t * buffer, FILE * file);
 int buffer_recv(options_t * options, buffer_t * buffer, message_t * message);
+int buffer_control(buffer_t * buffer, uint8_t type, void *data,
+		   uint16_t length, message_t * message);
+int buffer_journal_sync(buffer_t * buffer);
+int buffer_hash(buffer_t * buffer, sha256_t * ctx, uint32_t from, uint32_t to);
+int buffer_digest(buffer_t * buffer);
 int buffer_dump(buffer_t * buffer, FILE * file);
 int buffer_clean(buffer_t * buffer);
 
@@ -21,77 +21,882 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+#ifndef __KLIBC__
+#include <pthread.h>
+#endif
 
 #include "loopcast.h"
 
-struct itimerval reftimer, timer;
-network_t network;
+/* packets handled per wake up, so that timers are not starved */
+#define RECV_BUDGET 64
+/* relay: packets sent between two looks at the event loop */
+#define RELAY_BUDGET 16
 
-void alarm_maxwait(int i)
+/* The image digest is computed over the contiguous prefix of received
+ * chunks while the rest is still coming, on its own thread, so only the
+ * last few chunks remain to be hashed when the image is complete. klibc
+ * has no threads, the hashing is then done inline. */
+typedef struct hasher_s {
+#ifndef __KLIBC__
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	buffer_t *buffer;
+	sha256_t ctx;
+	uint32_t hashed;
+	uint32_t available;
+	/* the image size, 0 while a streaming sender has not told it */
+	uint32_t final;
+	int done;
+	uint8_t digest[DIGESTSIZE];
+} hasher_t;
+
+/* Peer repair: every PEERINTERVAL or so (jittered), the chunks missed
+ * behind the sender's position are asked to the segment, less those another
+ * receiver just asked for. Receivers holding them answer after a random
+ * backoff unless the chunk went by in the meantime, so usually only one
+ * does, and the sender is not involved. */
+typedef struct peers_s {
+	uint8_t *requested;
+	uint8_t *answer;
+	uint32_t nanswers;
+	uint32_t highest;
+	time_t heard;
+	unsigned long asked, sent;
+	event_t socket, nack, backoff;
+} peers_t;
+
+/* Layered multicast: every LAYERINTERVAL, the loss over the layers joined
+ * is worked out from the gaps between the chunks of each layer, which are
+ * evenly spaced. Above LAYERLOSS the last layer is left, and joining it
+ * again waits twice as long as before, and the loss is ignored while the
+ * switches catch up. Otherwise the next one is joined once there was no
+ * loss for that long. */
+typedef struct layers_s {
+	int joined;
+	uint32_t last[MAXLAYERS];
+	unsigned long received, expected;
+	long wait[MAXLAYERS];
+	long quiet, settle;
+	event_t socket[MAXLAYERS], timer;
+} layers_t;
+
+typedef struct receiver_s {
+	options_t options;
+	network_t network;
+	buffer_t buffer;
+	hasher_t hasher;
+	event_t repair;
+	event_t journal;
+	message_t message;
+	/* relay: a sender on the relay interface, with its own settings */
+	options_t relayoptions;
+	network_t relay;
+	event_t relaykeepalive;
+	peers_t peers;
+	layers_t layers;
+	int done;
+} receiver_t;
+
+/* hash what has been handed over, returns 1 once the whole image is done */
+int hasher_step(hasher_t * hasher, uint32_t available, uint32_t final)
+{
+	buffer_t *buffer = hasher->buffer;
+
+	buffer_hash(buffer, &hasher->ctx, hasher->hashed, available);
+	hasher->hashed = available;
+	if (!final || hasher->hashed < final) {
+		return 0;
+	}
+	sha256_final(&hasher->ctx, hasher->digest);
+	return 1;
+}
+
+#ifndef __KLIBC__
+void *hasher_loop(void *arg)
+{
+	hasher_t *hasher = arg;
+	uint32_t available, final;
+	int done;
+
+	do {
+		pthread_mutex_lock(&hasher->lock);
+		while (hasher->available == hasher->hashed && !hasher->done
+		       && (!hasher->final || hasher->hashed < hasher->final)) {
+			pthread_cond_wait(&hasher->cond, &hasher->lock);
+		}
+		available = hasher->available;
+		final = hasher->final;
+		done = hasher->done;
+		pthread_mutex_unlock(&hasher->lock);
+		if (done) {
+			break;
+		}
+		done = hasher_step(hasher, available, final);
+		pthread_mutex_lock(&hasher->lock);
+		hasher->done = done;
+		pthread_cond_signal(&hasher->cond);
+		pthread_mutex_unlock(&hasher->lock);
+	} while (!done);
+	return NULL;
+}
+#endif
+
+int hasher_init(hasher_t * hasher, buffer_t * buffer)
+{
+	memset(hasher, 0, sizeof(hasher_t));
+	hasher->buffer = buffer;
+	sha256_init(&hasher->ctx);
+#ifndef __KLIBC__
+	pthread_mutex_init(&hasher->lock, NULL);
+	pthread_cond_init(&hasher->cond, NULL);
+	if (pthread_create(&hasher->thread, NULL, hasher_loop, hasher)) {
+		ERROR(("hasher_init: Unable to start the digest thread"));
+	}
+#endif
+	return 1;
+}
+
+/* hand the new contiguous chunks over */
+int hasher_feed(hasher_t * hasher)
+{
+	buffer_t *buffer = hasher->buffer;
+	uint32_t contiguous = buffer->contiguous;
+	uint32_t final = buffer->streaming ? 0 : buffer->nchunks;
+
+	/* while streaming, the last chunk so far may be a short one */
+	if (!final && contiguous && contiguous == buffer->nchunks) {
+		contiguous--;
+	}
+	if (contiguous == hasher->available && final == hasher->final) {
+		return 0;
+	}
+#ifndef __KLIBC__
+	pthread_mutex_lock(&hasher->lock);
+	hasher->available = contiguous;
+	hasher->final = final;
+	pthread_cond_signal(&hasher->cond);
+	pthread_mutex_unlock(&hasher->lock);
+#else
+	hasher->available = contiguous;
+	hasher->final = final;
+	hasher->done = hasher_step(hasher, contiguous, final);
+#endif
+	return 1;
+}
+
+/* wait for the image digest once all chunks are there */
+uint8_t *hasher_wait(hasher_t * hasher)
+{
+#ifndef __KLIBC__
+	pthread_mutex_lock(&hasher->lock);
+	while (!hasher->done) {
+		pthread_cond_wait(&hasher->cond, &hasher->lock);
+	}
+	pthread_mutex_unlock(&hasher->lock);
+#endif
+	return hasher->digest;
+}
+
+int hasher_clean(hasher_t * hasher)
+{
+#ifndef __KLIBC__
+	pthread_mutex_lock(&hasher->lock);
+	hasher->done = 1;
+	pthread_cond_signal(&hasher->cond);
+	pthread_mutex_unlock(&hasher->lock);
+	pthread_join(hasher->thread, NULL);
+	pthread_mutex_destroy(&hasher->lock);
+	pthread_cond_destroy(&hasher->cond);
+#endif
+	return 1;
+}
+
+/* the image is complete, check it against the sender's digest. Returns 0
+ * when it must not be written yet */
+int receiver_verify(receiver_t * receiver)
+{
+	options_t *options = &receiver->options;
+	buffer_t *buffer = &receiver->buffer;
+
+	if (!buffer->hasdigest) {
+		if (options->verifydigest) {
+			DEBUGP(("receiver_verify: waiting for the digest\n"));
+			return 0;
+		}
+		return 1;
+	}
+	if (memcmp(hasher_wait(&receiver->hasher), buffer->digest,
+		   DIGESTSIZE)) {
+		if (options->verifydigest) {
+			ERROR(("Image digest mismatch, nothing written\n"));
+		}
+		do_printf("Warning: image digest mismatch\n");
+	} else if (options->verbose) {
+		do_printf("Image digest verified\n");
+	}
+	return 1;
+}
+
+/* Relay: the receiver is also a sender on <relay interface>, for the
+ * clients of that segment. Validated chunks are forwarded as they arrive,
+ * and once the image is complete it is looped from the chunk store like
+ * loopsend would, until the segment's keepalives expire. */
+int relay_init(receiver_t * receiver)
+{
+	options_t *options = &receiver->relayoptions;
+	unsigned char zero = 0;
+
+	*options = receiver->options;
+	options->sender = SENDER;
+	options->bwlimit = 0;
+	options->npeers = 0;
+	options->repair = 0;
+	options->clientsnumber = 0;
+	interfaces_init(options, receiver->options.relay);
+	options->ninterfaces = 1;
+	if (options->keepalives) {
+		options->maxwait = receiver->options.maxwait + 1;
+	}
+	network_init(options, &receiver->relay);
+	/* our own receive socket has joined the group too */
+	setsockopt(receiver->relay.data.sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+		   &zero, sizeof(zero));
+	return 1;
+}
+
+/* a copy of what was just validated, the repair announcements excepted
+ * since the clients of the relay can't ask it for chunks */
+int relay_forward(receiver_t * receiver, message_t * message, uint32_t crc)
+{
+	control_t *control = (control_t *) message->chunk.data;
+
+	if (!message->chunk.n && control->type == CONTROL_REPAIR) {
+		return 0;
+	}
+	message->crc = crc;
+	network_send(&receiver->relay, message);
+	trace(TRACE_SEND, message->chunk.n);
+	return 1;
+}
+
+int on_relay_keepalive(evloop_t * loop, event_t * event)
 {
-	signal(SIGALRM, alarm_maxwait);
-	timer = reftimer;
-	setitimer(ITIMER_REAL, &timer, NULL);
-	network_send_keepalive(&network);
+	receiver_t *receiver = event->data;
+
+	network_recv_keepalives(&receiver->relayoptions, &receiver->relay,
+				0);
+	return 1;
+}
+
+long relay_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* loop the complete image on the relay interface, the event loop is run
+ * between batches, and waited on to keep the bandwidth limit */
+int relay_serve(receiver_t * receiver, evloop_t * loop)
+{
+	options_t *options = &receiver->relayoptions;
+	buffer_t *buffer = &receiver->buffer;
+	message_t *frame;
+	time_t starttime, check = 0;
+	long interval = 0, next, wait;
+	uint32_t i = 0, loops = 0, n;
+
+	/* the image is written, let the reader of stdout go on, and stop
+	 * listening to our own sender */
+	fclose(stdout);
+	setsockopt(receiver->network.data.sock, IPPROTO_IP, IP_DROP_MEMBERSHIP,
+		   (const void *)&receiver->network.data.imreq,
+		   sizeof(struct ip_mreq));
+	if (options->egress[0].bwlimit) {
+		interval = 1000000L * sizeof(message_t) /
+		    (1024L * options->egress[0].bwlimit);
+	}
+	if (receiver->options.verbose) {
+		do_printf("Relaying the image through %s\n",
+			  options->egress[0].interface);
+	}
+	starttime = time(NULL);
+	next = relay_now();
+	loop->stop = 0;
+	while (!loop->stop) {
+		for (n = 0; n < RELAY_BUDGET; n++, i++) {
+			if (i == buffer->nchunks) {
+				i = 0;
+				loops++;
+				trace(TRACE_LOOP, loops);
+			}
+			if (!(i % SLABCHUNKS) && buffer->hasdigest) {
+				buffer_control(buffer, CONTROL_DIGEST,
+					       buffer->digest, DIGESTSIZE,
+					       &receiver->message);
+				network_send(&receiver->relay,
+					     &receiver->message);
+			}
+			frame = buffer_frame(buffer, i, &receiver->message);
+			network_send(&receiver->relay, frame);
+			trace(TRACE_SEND, i + 1);
+		}
+		next += RELAY_BUDGET * interval;
+		wait = interval ? (next - relay_now()) / 1000 : 0;
+		evloop_run(loop, wait > 0 ? wait : 0);
+		if (time(NULL) == check) {
+			continue;
+		}
+		check = time(NULL);
+		if (options->keepalives) {
+			if (!network_recv_keepalives(options, &receiver->relay,
+						     starttime)) {
+				break;
+			}
+		} else if (options->maxwait
+			   && difftime(check, starttime) > options->maxwait) {
+			break;
+		}
+	}
+	if (receiver->options.verbose) {
+		do_printf("Relay stopped after %u loops\n", loops);
+	}
+	return 1;
+}
+
+/* allocated with the store, sized like it for a streamed image to grow */
+int peers_alloc(peers_t * peers, buffer_t * buffer)
+{
+	if (peers->requested || !buffer->present) {
+		return buffer->present != NULL;
+	}
+	peers->requested = calloc(1, (buffer->maxchunks + 7) / 8);
+	peers->answer = calloc(1, (buffer->maxchunks + 7) / 8);
+	if (!peers->requested || !peers->answer) {
+		ERROR(("peers_alloc: Not enough memory"));
+	}
+	return 1;
+}
+
+/* chunk <n> went by, no need to answer for it */
+void peers_seen(peers_t * peers, buffer_t * buffer, uint32_t n)
+{
+	if (!n || n > buffer->nchunks) {
+		return;
+	}
+	if (n > peers->highest) {
+		peers->highest = n;
+	}
+	n--;
+	if (peers->answer && peers->answer[n / 8] & (1 << (n % 8))) {
+		peers->answer[n / 8] &= ~(1 << (n % 8));
+		peers->nanswers--;
+	}
+}
+
+int on_nack(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	peers_t *peers = &receiver->peers;
+
+	if (!receiver->done && peers_alloc(peers, &receiver->buffer)) {
+		peers->asked +=
+		    network_send_nack(&receiver->network, &receiver->buffer,
+				      peers->requested, peers->highest);
+		memset(peers->requested, 0,
+		       (receiver->buffer.nchunks + 7) / 8);
+	}
+	event_timer_set(event, PEERINTERVAL + rand() % PEERINTERVAL);
+	return 1;
+}
+
+int on_peer_request(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	peers_t *peers = &receiver->peers;
+	buffer_t *buffer = &receiver->buffer;
+	repair_t request;
+	uint32_t r, i, first, count, budget;
+
+	while (network_recv_nack(&receiver->network, &request)) {
+		if (!peers_alloc(peers, buffer)) {
+			continue;
+		}
+		peers->heard = time(NULL);
+		budget = REPAIRBUDGET;
+		for (r = 0; r < request.nranges; r++) {
+			first = ntohl(request.ranges[r].first);
+			count = ntohl(request.ranges[r].count);
+			if (first >= buffer->nchunks
+			    || count > buffer->nchunks - first) {
+				break;
+			}
+			for (i = first; i < first + count; i++) {
+				peers->requested[i / 8] |= 1 << (i % 8);
+				if (!budget || !buffer_has(buffer, i)
+				    || peers->answer[i / 8] & (1 << (i % 8))) {
+					continue;
+				}
+				peers->answer[i / 8] |= 1 << (i % 8);
+				peers->nanswers++;
+				budget--;
+			}
+		}
+	}
+	return 1;
+}
+
+/* the backoff expired, send what nobody else did */
+int on_answer(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	peers_t *peers = &receiver->peers;
+	message_t *frame;
+	uint32_t i;
+
+	for (i = 0; peers->nanswers && i < receiver->buffer.nchunks; i++) {
+		if (!peers->answer[i / 8]) {
+			i |= 7;
+			continue;
+		}
+		if (!(peers->answer[i / 8] & (1 << (i % 8)))) {
+			continue;
+		}
+		peers->answer[i / 8] &= ~(1 << (i % 8));
+		peers->nanswers--;
+		frame = buffer_frame(&receiver->buffer, i, &receiver->message);
+		network_send_peer(&receiver->network, frame);
+		peers->sent++;
+	}
+	event_timer_set(event, 1 + rand() % PEERBACKOFF);
+	return 1;
+}
+
+/* Our image is written, but the others may still need it. The exit code
+ * is returned right away, and a child keeps answering requests until none
+ * were heard for PEERLINGER seconds. */
+int peers_linger(receiver_t * receiver, evloop_t * loop)
+{
+	peers_t *peers = &receiver->peers;
+
+	fflush(stdout);
+	if (fork()) {
+		return 0;
+	}
+	fclose(stdout);
+	/* the capture is the parent's, and flushed by it */
+	receiver->network.capture = NULL;
+	peers->heard = time(NULL);
+	loop->stop = 0;
+	while (difftime(time(NULL), peers->heard) < PEERLINGER) {
+		evloop_run(loop, 1000);
+	}
+	if (receiver->options.verbose) {
+		do_printf("peer repair: %lu chunks sent\n", peers->sent);
+	}
+	_exit(0);
+}
+
+/* chunk <n> came through <layer> */
+void layers_seen(options_t * options, layers_t * layers, int layer,
+		 uint32_t n, buffer_t * buffer)
+{
+	uint32_t last = layers->last[layer], nchunks = buffer->nchunks;
+	uint32_t span, stride, missed, i;
+
+	/* still queued on a layer just left */
+	if (layer >= layers->joined) {
+		return;
+	}
+	layers->received++;
+	layers->expected++;
+	if (!last) {
+		layers->last[layer] = n;
+		return;
+	}
+	if (n > last) {
+		span = n - last;
+	} else if (last - n > nchunks / 2) {
+		span = nchunks - last + n;
+	} else {
+		/* out of order, a peer repair answer */
+		return;
+	}
+	layers->last[layer] = n;
+	stride = 1U << (options->layers - 1);
+	if (layer) {
+		stride = stride * 2 >> layer;
+	}
+	/* the chunks elided by a sparse sender were not lost */
+	if (span > stride) {
+		missed = (span - stride / 2) / stride;
+		for (i = 1; i <= missed; i++) {
+			if (!buffer_is_sparse(buffer, (last - 1 + i * stride) %
+					      nchunks)) {
+				layers->expected++;
+			}
+		}
+	}
+}
+
+int on_layers(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	options_t *options = &receiver->options;
+	layers_t *layers = &receiver->layers;
+	unsigned long loss;
+	int top;
+
+	if (receiver->done || !layers->expected) {
+		return 1;
+	}
+	loss = layers->expected > layers->received ?
+	    (layers->expected - layers->received) * 100 / layers->expected : 0;
+	DEBUGP(("on_layers: %d layers, %lu%% loss\n", layers->joined, loss));
+	if (layers->settle > 0) {
+		/* a layer just left may still be delivered for a while */
+		layers->settle -= LAYERINTERVAL;
+	} else if (loss > LAYERLOSS) {
+		layers->quiet = 0;
+		if (layers->joined > 1) {
+			top = --layers->joined;
+			network_join_layer(options, &receiver->network, top, 0);
+			layers->last[top] = 0;
+			if (layers->wait[top] < LAYERMAXJOIN) {
+				layers->wait[top] *= 2;
+			}
+			layers->settle = LAYERSETTLE;
+		}
+	} else {
+		layers->quiet += LAYERINTERVAL;
+		if (layers->joined < options->layers
+		    && layers->quiet >= layers->wait[layers->joined]) {
+			network_join_layer(options, &receiver->network,
+					   layers->joined, 1);
+			layers->joined++;
+			layers->quiet = 0;
+		}
+	}
+	layers->received = layers->expected = 0;
+	return 1;
+}
+
+int on_keepalive(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	buffer_t *buffer = &receiver->buffer;
+
+	/* relaying: our sender may stop, the clients of the relay keep
+	 * it going */
+	if (receiver->done) {
+		return 1;
+	}
+	if (buffer->present) {
+		receiver->network.completion =
+		    (uint64_t)buffer->received * 100 / buffer->nchunks;
+		/* the size is not known yet, we can't be done */
+		if (buffer->streaming && receiver->network.completion == 100) {
+			receiver->network.completion = 99;
+		}
+	}
+	if (receiver->options.feedback) {
+		event_timer_set(event,
+				network_send_feedback(&receiver->options,
+						      &receiver->network,
+						      event->interval));
+	} else {
+		network_send_keepalive(&receiver->network);
+	}
+	return 1;
+}
+
+int on_feedback(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+
+	network_recv_feedback(&receiver->options, &receiver->network);
+	return 1;
+}
+
+/* resumable receive: what came since the last time is saved */
+int on_journal(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+
+	if (!receiver->done) {
+		buffer_journal_sync(&receiver->buffer);
+	}
+	return 1;
+}
+
+int on_repair(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+
+	network_send_repair(&receiver->network, &receiver->buffer);
+	return 1;
+}
+
+/* command mode: obey a command (-c on the sender) whatever we were doing,
+ * acknowledge it and exit with its value */
+int on_command(evloop_t * loop, receiver_t * receiver)
+{
+	options_t *options = &receiver->options;
+	command_t *command = (command_t *) & receiver->message;
+
+	if (!network_check_command(options, &receiver->network, command)) {
+		return 0;
+	}
+	receiver->buffer.returnvalue = command->returnvalue;
+	if (options->keepalives) {
+		/* we are gone once it is sent, make it less likely to be lost */
+		network_send_ack(&receiver->network, receiver->network.seq,
+				 command->returnvalue);
+		network_send_ack(&receiver->network, receiver->network.seq,
+				 command->returnvalue);
+	}
+	if (options->verbose) {
+		do_printf("Command received (=%d), exiting\n",
+			  command->returnvalue);
+	}
+	loop->stop = 1;
+	return 1;
+}
+
+int on_data(evloop_t * loop, event_t * event)
+{
+	receiver_t *receiver = event->data;
+	options_t *options = &receiver->options;
+	buffer_t *buffer = &receiver->buffer;
+	uint32_t crc;
+	int n, layer = 0, l;
+
+	for (l = 1; l < options->layers; l++) {
+		if (event == &receiver->layers.socket[l]) {
+			layer = l;
+		}
+	}
+	for (n = 0; n < RECV_BUDGET && !loop->stop; n++) {
+		if (!network_recv_layer(options, &receiver->network, layer,
+					&receiver->message)) {
+			break;
+		}
+		/* relaying or lingering: only what the peers send matters */
+		if (receiver->done) {
+			if (options->peerrepair) {
+				peers_seen(&receiver->peers, buffer,
+					   receiver->message.chunk.n);
+			}
+			continue;
+		}
+		if (!layer
+		    && receiver->network.data.status == sizeof(command_t)) {
+			on_command(loop, receiver);
+			break;
+		}
+		crc = receiver->message.crc;
+		switch (buffer_recv(options, buffer, &receiver->message)) {
+		case 0:
+			continue;
+		case 1:
+			if (options->relay) {
+				relay_forward(receiver, &receiver->message, crc);
+			}
+			if (options->peerrepair) {
+				peers_seen(&receiver->peers, buffer,
+					   receiver->message.chunk.n);
+			}
+			if (options->layers > 1) {
+				layers_seen(options, &receiver->layers, layer,
+					    receiver->message.chunk.n, buffer);
+			}
+			progress_update(options, &receiver->network, buffer);
+			break;
+		case 2:
+			if (options->peerrepair) {
+				peers_seen(&receiver->peers, buffer,
+					   receiver->message.chunk.n);
+			}
+			if (options->layers > 1) {
+				layers_seen(options, &receiver->layers, layer,
+					    receiver->message.chunk.n, buffer);
+			}
+			break;
+		case 3:
+			/* control frames don't carry the return value, but
+			 * the repair one: the sender multicasts nothing else */
+			if (options->exitonvalue && !buffer->repairing) {
+				continue;
+			}
+			if (options->exitonvalue) {
+				break;
+			}
+			if (options->relay) {
+				relay_forward(receiver, &receiver->message, crc);
+			}
+			progress_update(options, &receiver->network, buffer);
+			/* the carousel stopped, ask for what is missing */
+			if (buffer->repairing && !receiver->network.repairing) {
+				if (options->verbose) {
+					do_printf
+					    ("Sender switched to unicast repair, %d chunks missing\n",
+					     buffer->nchunks - buffer->received);
+				}
+				network_repair_init(options, &receiver->network);
+				network_send_repair(&receiver->network, buffer);
+				event_timer(loop, &receiver->repair,
+					    REPAIRINTERVAL, on_repair,
+					    receiver);
+			}
+			break;
+		}
+		if (options->exitonvalue) {
+			if (options->verbose) {
+				do_printf
+				    ("Return code is now known (=%d), exiting\n",
+				     buffer->returnvalue);
+			}
+			loop->stop = 1;
+			break;
+		}
+		hasher_feed(&receiver->hasher);
+		if (buffer->present && buffer->received == buffer->nchunks
+		    && !buffer->streaming
+		    && receiver_verify(receiver)
+		    && buffer_dump(buffer, stdout)) {
+			trace(TRACE_DONE, buffer->nchunks);
+			/* the image is out, nothing to resume anymore */
+			if (options->journal) {
+				unlink(options->journal);
+			}
+			/* let the sender count us as done, even with -f: the
+			 * repair and the daemon's end of wave wait for it, it
+			 * must not be sampled or suppressed */
+			if (options->keepalives) {
+				receiver->network.completion = 100;
+				network_send_keepalive(&receiver->network);
+			}
+			if (options->verbose) {
+				do_printf("Successfully received\n");
+			}
+			receiver->done = 1;
+			loop->stop = 1;
+		}
+	}
+	return 1;
+}
+
+int on_signal(evloop_t * loop, event_t * event)
+{
+	if (event->signo == SIGQUIT) {
+		trace_dump(NULL);
+	}
+	return 1;
 }
 
 int main(int argc, char *argv[])
 {
-	buffer_t buffer;
-	message_t message;
-	options_t options;
-	uint8_t loop;
-	int returnvalue;
+	receiver_t receiver;
+	evloop_t loop;
+	event_t data, keepalive, feedback, signals;
+	sigset_t set;
+	int l;
 
+	memset(&receiver, 0, sizeof(receiver));
 	DEBUGP(("Calling options_init\n"));
-	options_init(&options, RECEIVER, argc, argv);
+	options_init(&receiver.options, RECEIVER, argc, argv);
+	trace_init(&receiver.options);
 	DEBUGP(("Calling network_init\n"));
-	network_init(&options, &network);
+	network_init(&receiver.options, &receiver.network);
+	if (receiver.options.relay) {
+		relay_init(&receiver);
+	}
+	progress_init(&receiver.options, &receiver.network);
 	DEBUGP(("Calling buffer_init\n"));
-	buffer_init(&options, &buffer, NULL);
-	if (options.keepalives) {
-		DEBUGP(("Start to send keepalives\n"));
-		network_send_keepalive(&network);
-		signal(SIGALRM, alarm_maxwait);
-		reftimer = options.maxwait_itimer;
-		timer = reftimer;
-		setitimer(ITIMER_REAL, &timer, NULL);
-	}
-	loop = 0;
-	while (1) {
-		DEBUGP(("Start main receive loop\n"));
-		if (network_recv(&options, &network, &message)) {
-			if (buffer_recv(&options, &buffer, &message)) {
-				if (options.exitonvalue) {
-					signal(SIGALRM, SIG_IGN);
-					network_clean(&network);
-					returnvalue = message.chunk.returnvalue;
-					buffer_clean(&buffer);
-					if (options.verbose) {
-						do_printf
-						    ("Return code is now known (=%d), exiting\n",
-						     returnvalue);
-					}
-					return returnvalue;
-				}
-				loop++;
-				if (!(loop % ((2 * 1024 * 1024) / CHUNKSIZE))) {
-					if (buffer_dump(&buffer, stdout)) {
-						network_clean(&network);
-						returnvalue =
-						    buffer.
-						    chunks[0].returnvalue;
-						buffer_clean(&buffer);
-						if (options.verbose) {
-							do_printf
-							    ("Successfully received\n");
-						}
-						break;
-					}
-				}
-			}
+	buffer_init(&receiver.options, &receiver.buffer, NULL);
+	evloop_init(&loop);
+	sigemptyset(&set);
+	sigaddset(&set, SIGQUIT);
+	event_signals(&loop, &signals, &set, on_signal, &receiver);
+	/* started once the signals are blocked, it inherits the mask */
+	if (!receiver.options.exitonvalue) {
+		hasher_init(&receiver.hasher, &receiver.buffer);
+	}
+	event_fd(&loop, &data, receiver.network.data.sock, on_data, &receiver);
+	if (receiver.options.peerrepair) {
+		srand(time(NULL) ^ getpid());
+		event_fd(&loop, &receiver.peers.socket,
+			 receiver.network.peerrecv.sock, on_peer_request,
+			 &receiver);
+		event_timer(&loop, &receiver.peers.nack,
+			    PEERINTERVAL + rand() % PEERINTERVAL, on_nack,
+			    &receiver);
+		event_timer(&loop, &receiver.peers.backoff, PEERBACKOFF,
+			    on_answer, &receiver);
+	}
+	if (receiver.options.journal) {
+		event_timer(&loop, &receiver.journal, JOURNALINTERVAL,
+			    on_journal, &receiver);
+	}
+	if (receiver.options.layers > 1) {
+		receiver.layers.joined = 1;
+		for (l = 1; l < receiver.options.layers; l++) {
+			receiver.layers.wait[l] = LAYERJOIN;
+			event_fd(&loop, &receiver.layers.socket[l],
+				 receiver.network.layer[l][0]->sock, on_data,
+				 &receiver);
 		}
+		event_timer(&loop, &receiver.layers.timer, LAYERINTERVAL,
+			    on_layers, &receiver);
+	}
+	if (receiver.relayoptions.keepalives) {
+		event_fd(&loop, &receiver.relaykeepalive,
+			 receiver.relay.keepalive.sock, on_relay_keepalive,
+			 &receiver);
+	}
+	if (receiver.options.feedback) {
+		/* receivers started together must not report together */
+		srand(time(NULL) ^ getpid());
+		event_fd(&loop, &feedback, receiver.network.feedback.sock,
+			 on_feedback, &receiver);
+		event_timer(&loop, &keepalive,
+			    1 + rand() % (receiver.options.maxwait * 1000L),
+			    on_keepalive, &receiver);
+	} else if (receiver.options.keepalives) {
+		DEBUGP(("Start to send keepalives\n"));
+		network_send_keepalive(&receiver.network);
+		event_timer(&loop, &keepalive, receiver.options.maxwait * 1000L,
+			    on_keepalive, &receiver);
+	}
+	DEBUGP(("Start main receive loop\n"));
+	while (!loop.stop) {
+		evloop_run(&loop, -1);
+	}
+	if (receiver.options.peerrepair && receiver.options.verbose) {
+		do_printf("peer repair: %lu chunks asked, %lu sent\n",
+			  receiver.peers.asked, receiver.peers.sent);
+	}
+	if (receiver.options.relay && receiver.done) {
+		relay_serve(&receiver, &loop);
+	} else if (receiver.options.peerrepair && receiver.done) {
+		peers_linger(&receiver, &loop);
+	}
+	if (receiver.options.relay) {
+		network_clean(&receiver.relay);
+	}
+	if (!receiver.options.exitonvalue) {
+		hasher_clean(&receiver.hasher);
 	}
-	return returnvalue;
+	evloop_clean(&loop);
+	network_clean(&receiver.network);
+	progress_clean(&receiver.network);
+	buffer_clean(&receiver.buffer);
+	return receiver.buffer.returnvalue;
 }
@@ -0,0 +1,350 @@
+/*
+    loopcast is a small client/server utility to distribute data or simple
+    orders to a high number of clients through a multicast network socket.
+
+    Copyright (C) 2010  Olivier Guerrier <olivier@guerrier.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Feed a capture (looprecv -W) through the receive path, network_recv and
+ * buffer_recv, as fast as possible or at the recorded pace, through a
+ * transport reading the capture instead of a socket. One line per run:
+ *   replay=<file> packets=<n> new=<n> dup=<n> control=<n> ignored=<n>
+ *   commands=<n> complete=<packet> capture_seconds=<f> complete_seconds=<f>
+ *   wall_seconds=<f> ns_per_packet=<f> cpu_ns_per_packet=<f> digest=<s>
+ * <complete> is the packet that completed the image (0 if it never did),
+ * <complete_seconds> when it arrived in the capture. The digest is checked
+ * after the run and is not timed, looprecv computes it on its own thread.
+ * With -g, nothing is replayed, the gaps between arrivals are reported:
+ *   gaps=<file> packets=<n> min_us=<f> p50_us=<f> p90_us=<f> p99_us=<f>
+ *   p999_us=<f> max_us=<f> mean_us=<f> stddev_us=<f>
+ * and with -v their histogram, one line per power of 2 of us. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loopcast.h"
+
+typedef struct replay_s {
+	uint8_t *capture;
+	size_t size;
+	size_t next;
+	/* per run, from here */
+	uint64_t time;
+	long packets;
+	long results[4];
+	long commands;
+	long complete;
+	uint64_t completetime;
+	int digest;
+} replay_t;
+
+replay_t replay;
+
+int replay_init(options_t * options, network_t * network)
+{
+	return 1;
+}
+
+int replay_send(network_t * network, netsock_t * sock, void *data, int len)
+{
+	return len;
+}
+
+/* the next datagram, whatever the socket it went through */
+int replay_recv(network_t * network, netsock_t * sock, void *data, int len)
+{
+	capturerecord_t *record;
+
+	if (sock != &network->data
+	    || replay.next + sizeof(capturerecord_t) > replay.size) {
+		return -1;
+	}
+	record = (capturerecord_t *) (replay.capture + replay.next);
+	if (replay.next + sizeof(capturerecord_t) + record->length >
+	    replay.size) {
+		return -1;
+	}
+	replay.time = record->time;
+	replay.next += sizeof(capturerecord_t) + record->length;
+	if (len > record->length) {
+		len = record->length;
+	}
+	memcpy(data, record + 1, len);
+	return len;
+}
+
+time_t replay_time(network_t * network)
+{
+	return replay.time / 1000000000ULL;
+}
+
+int replay_clean(network_t * network)
+{
+	return 1;
+}
+
+transport_t replay_transport = {
+	.init = replay_init,
+	.send = replay_send,
+	.recv = replay_recv,
+	.time = replay_time,
+	.clean = replay_clean,
+};
+
+uint64_t replay_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* at the recorded pace, wait until the next datagram's time */
+void replay_pace(uint64_t start)
+{
+	capturerecord_t *record;
+	struct timespec ts;
+	uint64_t at;
+
+	if (replay.next + sizeof(capturerecord_t) > replay.size) {
+		return;
+	}
+	record = (capturerecord_t *) (replay.capture + replay.next);
+	at = start + record->time;
+	ts.tv_sec = at / 1000000000ULL;
+	ts.tv_nsec = at % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* one pass over the capture, returns the wall and cpu time spent */
+void replay_run(options_t * options, network_t * network, int pace,
+		double *wall, double *cpu)
+{
+	buffer_t buffer;
+	message_t message;
+	uint8_t sent[DIGESTSIZE];
+	uint64_t start, cpustart;
+
+	memset(&replay.time, 0, sizeof(replay) - offsetof(replay_t, time));
+	replay.next = sizeof(capture_t);
+	buffer_init(options, &buffer, NULL);
+	start = trace_ns();
+	cpustart = replay_cpu_ns();
+	for (;;) {
+		if (pace) {
+			replay_pace(start);
+		}
+		if (!network_recv(options, network, &message)) {
+			break;
+		}
+		replay.packets++;
+		/* looprecv would obey it and exit */
+		if (network->data.status == sizeof(command_t)) {
+			replay.commands++;
+			continue;
+		}
+		replay.results[buffer_recv(options, &buffer, &message)]++;
+		if (!replay.complete && buffer.present
+		    && buffer.received == buffer.nchunks && !buffer.streaming) {
+			replay.complete = replay.packets;
+			replay.completetime = replay.time;
+		}
+	}
+	*cpu = (replay_cpu_ns() - cpustart) / 1e9;
+	*wall = (trace_ns() - start) / 1e9;
+	if (replay.complete && buffer.hasdigest) {
+		memcpy(sent, buffer.digest, DIGESTSIZE);
+		buffer_digest(&buffer);
+		replay.digest = memcmp(sent, buffer.digest, DIGESTSIZE) ? 2 : 1;
+	}
+	buffer_clean(&buffer);
+}
+
+int gap_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* inter-arrival gaps of all the datagrams, kernel times when the capture
+ * has them */
+int replay_gaps(char *filename, int verbose)
+{
+	capturerecord_t *record;
+	uint64_t *gaps, last = 0;
+	long n = 0, i, buckets[64];
+	double sum = 0, squares = 0, mean, stddev;
+	size_t next;
+	int b;
+
+	gaps = malloc(replay.size / sizeof(capturerecord_t) * sizeof(uint64_t));
+	if (!gaps) {
+		ERROR(("loopreplay: Not enough memory\n"));
+	}
+	for (next = sizeof(capture_t);
+	     next + sizeof(capturerecord_t) <= replay.size;
+	     next += sizeof(capturerecord_t) + record->length) {
+		record = (capturerecord_t *) (replay.capture + next);
+		if (next != sizeof(capture_t)) {
+			gaps[n] = record->time > last ? record->time - last : 0;
+			sum += gaps[n];
+			squares += (double)gaps[n] * gaps[n];
+			n++;
+		}
+		last = record->time;
+	}
+	if (!n) {
+		ERROR(("loopreplay: '%s' has less than two datagrams\n",
+		       filename));
+	}
+	qsort(gaps, n, sizeof(uint64_t), gap_compare);
+	mean = sum / n;
+	stddev = sqrt(squares / n - mean * mean > 0 ?
+		      squares / n - mean * mean : 0);
+	printf
+	    ("gaps=%s packets=%ld min_us=%.3f p50_us=%.3f p90_us=%.3f p99_us=%.3f p999_us=%.3f max_us=%.3f mean_us=%.3f stddev_us=%.3f\n",
+	     filename, n + 1, gaps[0] / 1e3, gaps[(n - 1) * 50 / 100] / 1e3,
+	     gaps[(n - 1) * 90 / 100] / 1e3, gaps[(n - 1) * 99 / 100] / 1e3,
+	     gaps[(n - 1) * 999 / 1000] / 1e3, gaps[n - 1] / 1e3, mean / 1e3,
+	     stddev / 1e3);
+	if (verbose) {
+		memset(buckets, 0, sizeof(buckets));
+		for (i = 0; i < n; i++) {
+			for (b = 0; b < 63 && gaps[i] >= 1000ULL << b; b++) ;
+			buckets[b]++;
+		}
+		for (b = 0; b < 64; b++) {
+			if (buckets[b]) {
+				printf("gap_us<%llu count=%ld\n", 1ULL << b,
+				       buckets[b]);
+			}
+		}
+	}
+	free(gaps);
+	return 0;
+}
+
+void replay_usage(char *me)
+{
+	do_printf("Usage:\n\t%s [options] <capture file>\n", me);
+	do_printf
+	    ("\t  -g : report the distribution of the gaps between arrivals, instead of replaying\n");
+	do_printf("\t  -h : this help screen\n");
+	do_printf
+	    ("\t  -p : at the recorded pace, instead of as fast as possible\n");
+	do_printf
+	    ("\t  -r <repeat> : runs over the capture, the fastest is reported (default 1)\n");
+	do_printf("\t  -v : be verbose\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char *noargs[] = { argv[0], NULL };
+	char *digests[] = { "none", "ok", "mismatch" };
+	char *filename;
+	options_t options;
+	network_t network;
+	capture_t *header;
+	struct stat st;
+	double wall, cpu, bestwall = 0, bestcpu = 0;
+	int optc, fd, r, pace = 0, repeat = 1, verbose = 0, gaps = 0;
+
+	while ((optc = getopt(argc, argv, "ghpr:v")) != EOF) {
+		switch (optc) {
+		case 'g':
+			gaps = 1;
+			break;
+		case 'p':
+			pace = 1;
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			replay_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || repeat < 1) {
+		replay_usage(argv[0]);
+	}
+	filename = argv[optind];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		ERROR(("loopreplay: Unable to open '%s'\n", filename));
+	}
+	replay.size = st.st_size;
+	if (replay.size < sizeof(capture_t)) {
+		ERROR(("loopreplay: '%s' is not a capture file\n",
+		       filename));
+	}
+	/* read in once, the file system is not part of the receive path */
+	replay.capture = mmap(NULL, replay.size, PROT_READ,
+			      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (replay.capture == MAP_FAILED) {
+		ERROR(("loopreplay: Unable to map '%s'\n", filename));
+	}
+	header = (capture_t *) replay.capture;
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic))
+	    || header->framesize != sizeof(message_t)) {
+		ERROR(("loopreplay: '%s' is not a capture file of %d bytes frames\n", filename, (int)sizeof(message_t)));
+	}
+	if (gaps) {
+		return replay_gaps(filename, verbose);
+	}
+
+	optind = 1;
+	options_init(&options, RECEIVER, 1, noargs);
+	options.maxchunks = header->maxchunks;
+	options.verbose = verbose;
+	options.transport = &replay_transport;
+	trace_init(&options);
+	network_init(&options, &network);
+	for (r = 0; r < repeat; r++) {
+		replay_run(&options, &network, pace, &wall, &cpu);
+		if (!r || wall < bestwall) {
+			bestwall = wall;
+			bestcpu = cpu;
+		}
+	}
+	printf
+	    ("replay=%s packets=%ld new=%ld dup=%ld control=%ld ignored=%ld commands=%ld complete=%ld capture_seconds=%.3f complete_seconds=%.3f wall_seconds=%.3f ns_per_packet=%.1f cpu_ns_per_packet=%.1f digest=%s\n",
+	     filename, replay.packets, replay.results[1],
+	     replay.results[2], replay.results[3], replay.results[0],
+	     replay.commands, replay.complete, replay.time / 1e9,
+	     replay.completetime / 1e9, bestwall,
+	     replay.packets ? bestwall * 1e9 / replay.packets : 0,
+	     replay.packets ? bestcpu * 1e9 / replay.packets : 0,
+	     digests[replay.digest]);
+	network_clean(&network);
+	munmap(replay.capture, replay.size);
+	return replay.complete ? 0 : 1;
+}
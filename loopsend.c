@@ -18,152 +18,695 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 
 #include "loopcast.h"
 
-volatile int lock = 0;
-struct itimerval reftimer, timer;
+#define STOP_LOOP 1
+#define STOP_NOW 2
 
-void sigalarm_unlock(int i)
+volatile int stop = 0;
+
+// one transmit worker per interface and layer, all serving the same buffer
+typedef struct worker_s {
+	pthread_t thread;
+	int index;
+	int layer;
+	int bwlimit;
+	long interval;
+	/* -1 if not pinned */
+	int cpu;
+	options_t *options;
+	network_t *network;
+	buffer_t *buffer;
+	uint32_t loops;
+	/* passes over the image, the first one included */
+	uint32_t pass;
+	long packets;
+} worker_t;
+
+void timespec_add(struct timespec *ts, long ns)
 {
-	lock = 0;
-	signal(SIGALRM, sigalarm_unlock);
-	timer = reftimer;
-	setitimer(ITIMER_REAL, &timer, NULL);
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+	while (ts->tv_nsec < 0) {
+		ts->tv_nsec += 1000000000L;
+		ts->tv_sec--;
+	}
 }
 
-volatile int waitclients = 1;
-void sigusr1_dontwait(int i)
+void worker_send(worker_t * worker, message_t * message,
+		 struct timespec *next)
 {
-	waitclients = 0;
-	signal(SIGUSR1, sigusr1_dontwait);
+	struct timespec now;
+	long wait;
+
+	network_send_layer(worker->network, worker->index, worker->layer,
+			   message);
+	trace(TRACE_SEND, message->chunk.n);
+	worker->packets++;
+	if (worker->interval) {
+		/* absolute deadlines, so that time spent sending is not
+		 * added to the gap */
+		timespec_add(next, worker->interval);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = (next->tv_sec - now.tv_sec) * 1000000000L +
+		    next->tv_nsec - now.tv_nsec;
+		trace(TRACE_PACE, wait > 0 ? wait : 0);
+		/* behind (page fault, preemption, control frame...): the
+		 * missed gaps are dropped, not made up with a burst */
+		if (wait <= 0) {
+			*next = now;
+			return;
+		}
+		if (!worker->options->busywait) {
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next,
+					NULL);
+			return;
+		}
+		/* the timer only gets close, the clock is read until the
+		 * deadline */
+		if (wait > BUSYWAIT) {
+			timespec_add(next, -BUSYWAIT);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next,
+					NULL);
+			timespec_add(next, BUSYWAIT);
+		}
+		while (wait > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait = (next->tv_sec - now.tv_sec) * 1000000000L +
+			    next->tv_nsec - now.tv_nsec;
+		}
+	}
 }
 
-void sigusr1_dummy(int i)
+/* low-jitter transmit: pinned, real-time, and without timer slack */
+void worker_realtime(worker_t * worker)
 {
-	signal(SIGUSR1, sigusr1_dummy);
+	options_t *options = worker->options;
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	if (worker->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+			do_printf("%s: Unable to pin worker to cpu %d\n",
+				  options->egress[worker->index].interface,
+				  worker->cpu);
+		}
+	}
+	if (options->rtprio) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = options->rtprio;
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+			do_printf
+			    ("%s: Unable to set SCHED_FIFO priority %d\n",
+			     options->egress[worker->index].interface,
+			     options->rtprio);
+		}
+	}
+	if (options->busywait) {
+		prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+	}
 }
 
-network_t *sigusr2_network;
-options_t *sigusr2_options;
-void sigusr2_dumpclients(int i)
+/* chunks are shared by the cooperative senders, and spread over the layers
+ * differently at each loop */
+int worker_owns(worker_t * worker, uint32_t chunk)
 {
-	network_dump_keepalives(sigusr2_options, sigusr2_network);
-	signal(SIGUSR2, sigusr2_dumpclients);
+	options_t *options = worker->options;
+
+	if (options->npeers > 1
+	    && network_peer_owner(options, worker->network,
+				  chunk) != options->peerindex) {
+		return 0;
+	}
+	if (options->layers > 1
+	    && chunk_layer(options, chunk, worker->pass) != worker->layer) {
+		return 0;
+	}
+	return 1;
+}
+
+void *worker_loop(void *arg)
+{
+	worker_t *worker = arg;
+	options_t *options = worker->options;
+	buffer_t *buffer = worker->buffer;
+	message_t message, *frame;
+	struct timespec next;
+	char name[IFNAMSIZ + 4];
+	uint32_t i;
+
+	/* one ring per worker, <interface>/<layer> when layered */
+	if (options->layers > 1) {
+		snprintf(name, sizeof(name), "%s/%d",
+			 options->egress[worker->index].interface,
+			 worker->layer);
+	} else {
+		snprintf(name, sizeof(name), "%s",
+			 options->egress[worker->index].interface);
+	}
+	trace_thread(name);
+	worker_realtime(worker);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	/* streaming: a first pass as the chunks are read, the loops start
+	 * once the whole image is there */
+	for (i = 0; options->stream && (buffer->streaming
+					 || i < buffer->nchunks);) {
+		if (stop == STOP_NOW) {
+			return NULL;
+		}
+		if (i == buffer->nchunks) {
+			usleep(1000);
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			continue;
+		}
+		/* the digest too, receivers resuming from a journal wait
+		 * for it */
+		if (!(i % SLABCHUNKS) && options->senddigest
+		    && buffer->hasdigest && !worker->layer) {
+			__sync_synchronize();
+			buffer_control(buffer, CONTROL_DIGEST, buffer->digest,
+				       DIGESTSIZE, &message);
+			worker_send(worker, &message, &next);
+		}
+		if (worker_owns(worker, i)) {
+			frame = buffer_frame(buffer, i, &message);
+			worker_send(worker, frame, &next);
+		}
+		i++;
+	}
+	if (options->stream) {
+		worker->pass++;
+	}
+	while (stop != STOP_LOOP) {
+		/* unicast repair: only tell the stragglers to ask */
+		if (worker->network->repairing) {
+			if (stop == STOP_NOW) {
+				return NULL;
+			}
+			if (worker->layer) {
+				usleep(REPAIRINTERVAL * 1000);
+				continue;
+			}
+			buffer_control(buffer, CONTROL_REPAIR, NULL, 0,
+				       &message);
+			network_send_egress(worker->network, worker->index,
+					    &message);
+			usleep(REPAIRINTERVAL * 1000);
+			continue;
+		}
+		/* the sparse map leads each loop, everybody gets the first
+		 * layer */
+		for (i = 0; !worker->layer && i < buffer->nsparseframes; i++) {
+			worker_send(worker, &buffer->sparseframes[i], &next);
+		}
+		for (i = 0; i < buffer->nchunks; i++) {
+			if (stop == STOP_NOW) {
+				return NULL;
+			}
+			if (worker->network->repairing) {
+				break;
+			}
+			/* once known, the image digest goes out every
+			 * SLABCHUNKS chunks */
+			if (!(i % SLABCHUNKS) && options->senddigest
+			    && buffer->hasdigest && !worker->layer) {
+				__sync_synchronize();
+				buffer_control(buffer, CONTROL_DIGEST,
+					       buffer->digest, DIGESTSIZE,
+					       &message);
+				worker_send(worker, &message, &next);
+			}
+			if (buffer_is_sparse(buffer, i)
+			    || !worker_owns(worker, i)) {
+				continue;
+			}
+			frame = buffer_frame(buffer, i, &message);
+			worker_send(worker, frame, &next);
+		}
+		worker->loops++;
+		worker->pass++;
+		trace(TRACE_LOOP, worker->loops);
+		if (worker->options->verbose) {
+			printf("%s: loop %u done\n",
+			       worker->options->egress[worker->index].interface,
+			       worker->loops);
+		}
+	}
+	return NULL;
 }
 
-void sigusr2_dummy(int i)
+/* layered: the first layer of each interface at its bandwidth limit, and
+ * each next one at the cumulative rate so far */
+int workers_start(options_t * options, network_t * network,
+		  buffer_t * buffer, worker_t * workers)
 {
-	signal(SIGUSR2, sigusr2_dummy);
+	int i, n, layers = options->layers > 1 ? options->layers : 1;
+	worker_t *worker;
+
+	for (n = 0; n < options->ninterfaces * layers; n++) {
+		worker = &workers[n];
+		i = n / layers;
+		memset(worker, 0, sizeof(worker_t));
+		worker->index = i;
+		worker->layer = n % layers;
+		worker->options = options;
+		worker->network = network;
+		worker->buffer = buffer;
+		worker->cpu = options->ncpus ? options->cpus[n % options->ncpus]
+		    : -1;
+		worker->bwlimit = options->egress[i].bwlimit;
+		if (!worker->bwlimit) {
+			worker->bwlimit = options->bwlimit;
+		}
+		if (layers > 1 && !worker->bwlimit) {
+			ERROR(("workers_start: layers need a bandwidth limit (-w)\n"));
+		}
+		if (worker->layer > 1) {
+			worker->bwlimit <<= worker->layer - 1;
+		}
+		if (worker->bwlimit) {
+			worker->interval =
+			    1000000000LL * sizeof(message_t) /
+			    (1024LL * worker->bwlimit);
+		}
+		if (options->verbose && layers > 1) {
+			do_printf
+			    ("%s: layer %d, bwlimit %d KiB/s, %ldns between packets\n",
+			     options->egress[i].interface, worker->layer,
+			     worker->bwlimit, worker->interval);
+		} else if (options->verbose) {
+			do_printf("%s: bwlimit %d KiB/s, %ldns between packets\n",
+				  options->egress[i].interface,
+				  worker->bwlimit, worker->interval);
+		}
+		if (pthread_create(&worker->thread, NULL, worker_loop, worker)) {
+			ERROR(("workers_start: Unable to start worker"));
+		}
+	}
+	return 1;
 }
 
-int main(int argc, char *argv[])
+int workers_stop(options_t * options, worker_t * workers, time_t starttime)
 {
-	buffer_t buffer;
-	message_t message;
-	network_t network;
+	double elapsed;
+	int i, layers = options->layers > 1 ? options->layers : 1;
+
+	elapsed = difftime(time(NULL), starttime);
+	for (i = 0; i < options->ninterfaces * layers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (options->verbose) {
+			do_printf
+			    ("%s: %ld packets, %ld bytes, %u loops, %.0f KiB/s\n",
+			     options->egress[workers[i].index].interface,
+			     workers[i].packets,
+			     workers[i].packets * sizeof(message_t),
+			     workers[i].loops,
+			     elapsed > 0 ? workers[i].packets *
+			     sizeof(message_t) / 1024.0 / elapsed : 0);
+		}
+	}
+	return 1;
+}
+
+typedef struct sender_s {
 	options_t options;
-	uint32_t i;
-	uint32_t loop = 0;
+	network_t network;
+	buffer_t buffer;
+	pthread_t digest;
+	worker_t workers[MAXINTERFACES * MAXLAYERS];
 	time_t starttime;
+	time_t peerstart;
 	int clients;
+	int waiting;
+	/* daemon: no wave is being sent */
+	int idle;
+} sender_t;
 
-	signal(SIGUSR1, sigusr1_dummy);
-	signal(SIGUSR2, sigusr2_dummy);
-	DEBUGP(("Calling options_init\n"));
-	options_init(&options, SENDER, argc, argv);
-	DEBUGP(("Calling network_init\n"));
-	network_init(&options, &network);
-	DEBUGP(("Calling buffer_init\n"));
-	buffer_init(&options, &buffer, stdin);
-	message.length = buffer.length;
-	signal(SIGUSR1, sigusr1_dontwait);
-	sigusr2_options = &options;
-	sigusr2_network = &network;
-	signal(SIGUSR2, sigusr2_dumpclients);
-	if (options.clientsnumber) {
-		starttime = time(NULL);
-		do {
-			sleep(1);
-			clients =
-			    network_recv_keepalives(&options, &network,
-						    starttime);
-			if (options.verbose) {
-				do_printf("Expecting %d clients, found %d\n",
-					  options.clientsnumber, clients);
+/* the digest is computed while waiting for clients and sending, workers
+ * start publishing it as soon as it is there. When streaming, stdin is
+ * read here and the digest comes at its end */
+void *digest_loop(void *arg)
+{
+	sender_t *sender = arg;
+	int i;
+
+	if (sender->options.stream) {
+		buffer_stream(&sender->options, &sender->buffer, stdin);
+	} else {
+		buffer_digest(&sender->buffer);
+	}
+	if (sender->options.verbose) {
+		do_printf("Image digest: ");
+		for (i = 0; i < DIGESTSIZE; i++) {
+			do_printf("%02x", sender->buffer.digest[i]);
+		}
+		do_printf("\n");
+	}
+	return NULL;
+}
+
+int on_signal(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+
+	switch (event->signo) {
+	case SIGUSR1:
+		if (sender->idle) {
+			if (sender->options.verbose) {
+				do_printf("SIGUSR1 received, starting a wave\n");
 			}
-		} while (clients < options.clientsnumber && waitclients);
-		if (options.verbose && !waitclients) {
-			do_printf
-			    ("SIGUSR1 received, starting with %d clients, where %d were expected\n",
-			     clients, options.clientsnumber);
-		}
-	}
-	if (options.verbose) {
-		printf("Start main loop\n");
-	}
-	if (options.output) {
-		network_dump_keepalives(&options, &network);
-	}
-	if (options.bwlimit) {
-		lock = 1;
-		signal(SIGALRM, sigalarm_unlock);
-		reftimer = options.bwlimit_itimer;
-		timer = reftimer;
-		setitimer(ITIMER_REAL, &timer, NULL);
-	}
-	starttime = time(NULL);
-	while (1) {
-		loop++;
-		if (options.verbose) {
-			printf("Loop %u :", loop);
-		}
-		for (i = 0; i < buffer.nchunks; i++) {
-			buffer_send(&buffer, i, &message);
-			network_send(&network, &message);
-			if (options.bwlimit) {
-				lock = 1;
-				while (lock) {
-					pause();
-				}	/* wait here until sigalarm release the lock */
+			sender->idle = 0;
+		}
+		if (sender->waiting) {
+			if (sender->options.verbose) {
+				do_printf
+				    ("SIGUSR1 received, starting with %d clients, where %d were expected\n",
+				     sender->clients,
+				     sender->options.clientsnumber);
 			}
-			if (options.keepalives) {
-				if (!network_recv_keepalives
-				    (&options, &network, starttime)) {
-					break;
-				}
+			sender->waiting = 0;
+		}
+		break;
+	case SIGUSR2:
+		network_dump_keepalives(&sender->options, &sender->network);
+		break;
+	case SIGQUIT:
+		trace_dump(NULL);
+		break;
+	}
+	return 1;
+}
+
+int on_keepalive(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+	int clients, done;
+
+	/* daemon: a wave starts with the first client still in need, or
+	 * the -N first ones */
+	if (sender->idle) {
+		network_recv_keepalives(&sender->options, &sender->network, 0);
+		clients = network_clients(&sender->network, &done) - done;
+		if (clients >= sender->options.clientsnumber && clients > 0) {
+			if (sender->options.verbose) {
+				do_printf("%d clients asking, starting a wave\n",
+					  clients);
 			}
+			sender->idle = 0;
 		}
-		if (options.verbose) {
-			printf("done\n");
+		return 1;
+	}
+	if (!sender->waiting) {
+		/* just record them, expiration is checked by on_tick */
+		network_recv_keepalives(&sender->options, &sender->network,
+					sender->starttime);
+		return 1;
+	}
+	clients = network_recv_keepalives(&sender->options, &sender->network, 0);
+	/* receivers with scalable feedback (-f) are mostly quiet */
+	if (sender->network.fleet > clients) {
+		clients = sender->network.fleet;
+	}
+	if (clients != sender->clients && sender->options.verbose) {
+		do_printf("Expecting %d clients, found %d\n",
+			  sender->options.clientsnumber, clients);
+	}
+	sender->clients = clients;
+	if (clients >= sender->options.clientsnumber) {
+		sender->waiting = 0;
+	}
+	return 1;
+}
+
+int on_repair(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+
+	network_serve_repair(&sender->options, &sender->network,
+			     &sender->buffer);
+	return 1;
+}
+
+int on_tick(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+	options_t *options = &sender->options;
+	int clients, done;
+
+	if (options->npeers > 1) {
+		network_announce(options, &sender->network, &sender->buffer);
+		network_peers(options, &sender->network, sender->peerstart);
+	}
+	if (options->keepalives) {
+		network_fleet(options, &sender->network);
+	}
+	if (sender->waiting || sender->idle) {
+		return 1;
+	}
+	/* daemon: the wave is over once everybody heard of is done, a
+	 * client that was not heard of yet starts the next one */
+	if (options->daemon) {
+		clients = network_clients(&sender->network, &done);
+		if (clients && done == clients) {
+			if (options->verbose) {
+				do_printf("%d clients done, end of the wave\n",
+					  clients);
+			}
+			stop = STOP_NOW;
+			return 1;
 		}
-		if (options.keepalives) {
-			if (!network_recv_keepalives
-			    (&options, &network, starttime)) {
-				if (options.verbose) {
-					do_printf
-					    ("no keepalive received, stop sending\n");
-				}
-				break;
+	}
+	if (options->repair && !sender->network.repairing) {
+		clients = network_clients(&sender->network, &done);
+		if (clients && done * 100 >= options->repair * clients) {
+			if (options->verbose) {
+				do_printf
+				    ("%d of %d clients done, switching to unicast repair\n",
+				     done, clients);
 			}
-		} else {
-			if (options.maxwait
-			    && (difftime(time(NULL), starttime) >
-				options.maxwait)) {
-				if (options.verbose) {
-					do_printf
-					    ("Max time reached after %ld seconds, stop sending\n",
-					     difftime(time(NULL), starttime));
-				}
-				break;
+			sender->network.repairing = 1;
+		}
+	}
+	if (options->keepalives) {
+		if (!network_recv_keepalives
+		    (options, &sender->network, sender->starttime)) {
+			if (options->verbose) {
+				do_printf("no keepalive received, stop sending\n");
 			}
+			stop = STOP_NOW;
+		}
+	} else {
+		if (options->maxwait
+		    && (difftime(time(NULL), sender->starttime) >
+			options->maxwait)) {
+			if (options->verbose) {
+				do_printf
+				    ("Max time reached after %ld seconds, stop sending\n",
+				     difftime(time(NULL), sender->starttime));
+			}
+			stop = STOP_LOOP;
+		}
+	}
+	return 1;
+}
+
+/* command mode: the command is repeated with exponential backoff, until
+ * enough clients acknowledged it or maxwait */
+int on_command(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+	options_t *options = &sender->options;
+
+	if (difftime(time(NULL), sender->starttime) > options->maxwait) {
+		if (options->verbose) {
+			do_printf("Max time reached, %d clients acknowledged\n",
+				  sender->network.acks);
+		}
+		sender->waiting = 0;
+		return 1;
+	}
+	network_send_command(options, &sender->network, options->returnvalue);
+	if (event->interval < COMMANDMAXBACKOFF) {
+		event_timer_set(event, event->interval * 2 < COMMANDMAXBACKOFF ?
+				event->interval * 2 : COMMANDMAXBACKOFF);
+	}
+	return 1;
+}
+
+int on_ack(evloop_t * loop, event_t * event)
+{
+	sender_t *sender = event->data;
+
+	network_recv_keepalives(&sender->options, &sender->network, 0);
+	if (sender->options.clientsnumber
+	    && sender->network.acks >= sender->options.clientsnumber) {
+		sender->waiting = 0;
+	}
+	return 1;
+}
+
+/* Daemon: back to idle, the next wave starts afresh. Keepalives of the
+ * previous one are forgotten, late completion reports start nothing */
+int daemon_idle(sender_t * sender)
+{
+	network_t *network = &sender->network;
+
+	stop = 0;
+	memset(network->keepalives, 0, sizeof(keepalive_t) * 256 * 256);
+	network->repairing = 0;
+	network->fleet = 0;
+	network->heard = 0;
+	network->heardsince = 0;
+	sender->idle = 1;
+	if (sender->options.verbose) {
+		do_printf("Idle, waiting for clients\n");
+	}
+	return 1;
+}
+
+/* returns 0 if the <-N> clients acknowledged the command */
+int command_run(sender_t * sender)
+{
+	options_t *options = &sender->options;
+	evloop_t loop;
+	event_t signals, ack, command;
+	sigset_t set;
+
+	evloop_init(&loop);
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGQUIT);
+	event_signals(&loop, &signals, &set, on_signal, sender);
+	event_fd(&loop, &ack, sender->network.keepalive.sock, on_ack, sender);
+	event_timer(&loop, &command, COMMANDBACKOFF, on_command, sender);
+
+	sender->starttime = time(NULL);
+	sender->waiting = 1;
+	network_send_command(options, &sender->network, options->returnvalue);
+	while (sender->waiting) {
+		evloop_run(&loop, -1);
+	}
+	network_dump_acks(options, &sender->network);
+	evloop_clean(&loop);
+	network_clean(&sender->network);
+	return options->clientsnumber
+	    && sender->network.acks < options->clientsnumber;
+}
+
+int main(int argc, char *argv[])
+{
+	sender_t sender;
+	evloop_t loop;
+	event_t signals, keepalive, tick, repair;
+	sigset_t set;
+
+	/* blocked before anything else: loading a large image takes a while,
+	 * and the default action would kill us. They are read from the event
+	 * loop once it runs, the workers inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGQUIT);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	memset(&sender, 0, sizeof(sender));
+	DEBUGP(("Calling options_init\n"));
+	options_init(&sender.options, SENDER, argc, argv);
+	trace_init(&sender.options);
+	if (sender.options.compile) {
+		sender.options.stream = 0;
+		buffer_init(&sender.options, &sender.buffer, stdin);
+		buffer_compile(&sender.options, &sender.buffer,
+			       sender.options.compile);
+		buffer_clean(&sender.buffer);
+		return 0;
+	}
+	DEBUGP(("Calling network_init\n"));
+	network_init(&sender.options, &sender.network);
+	if (sender.options.command) {
+		return command_run(&sender);
+	}
+	DEBUGP(("Calling buffer_init\n"));
+	buffer_init(&sender.options, &sender.buffer, stdin);
+	/* no page fault on the transmit path either, the worker stacks and
+	 * the streaming arena included */
+	if (sender.options.busywait && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		do_printf
+		    ("Unable to lock the image in memory (RLIMIT_MEMLOCK?), continuing\n");
+	}
+
+	evloop_init(&loop);
+	event_signals(&loop, &signals, &set, on_signal, &sender);
+	if (sender.options.npeers > 1) {
+		sender.peerstart = network_time(&sender.network);
+		network_announce(&sender.options, &sender.network,
+				 &sender.buffer);
+		network_peers(&sender.options, &sender.network,
+			      sender.peerstart);
+	}
+	if (sender.options.keepalives || sender.options.npeers) {
+		event_fd(&loop, &keepalive, sender.network.keepalive.sock,
+			 on_keepalive, &sender);
+	}
+	event_timer(&loop, &tick, 100, on_tick, &sender);
+	if (sender.options.repair) {
+		event_fd(&loop, &repair, sender.network.repair.sock, on_repair,
+			 &sender);
+	}
+	/* a carousel file comes with its digest */
+	if (!sender.buffer.hasdigest
+	    && pthread_create(&sender.digest, NULL, digest_loop, &sender)) {
+		ERROR(("Unable to start the digest thread"));
+	}
+
+	/* a daemon waits for -N clients at each wave */
+	if (sender.options.daemon) {
+		daemon_idle(&sender);
+	} else {
+		sender.waiting = sender.options.clientsnumber;
+	}
+	do {
+		while (sender.waiting || sender.idle) {
+			evloop_run(&loop, -1);
+		}
+		if (sender.options.verbose) {
+			printf("Start main loop\n");
+		}
+		if (sender.options.output) {
+			network_dump_keepalives(&sender.options,
+						&sender.network);
+		}
+		sender.starttime = time(NULL);
+		workers_start(&sender.options, &sender.network, &sender.buffer,
+			      sender.workers);
+		while (!stop) {
+			evloop_run(&loop, -1);
 		}
+		workers_stop(&sender.options, sender.workers,
+			     sender.starttime);
+	} while (sender.options.daemon && daemon_idle(&sender));
+	if (!sender.options.carousel) {
+		pthread_join(sender.digest, NULL);
 	}
-	network_clean(&network);
-	buffer_clean(&buffer);
+	evloop_clean(&loop);
+	network_clean(&sender.network);
+	buffer_clean(&sender.buffer);
 	return 0;
 }
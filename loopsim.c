@@ -0,0 +1,455 @@
+/*
+    loopcast is a small client/server utility to distribute data or simple
+    orders to a high number of clients through a multicast network socket.
+
+    Copyright (C) 2010  Olivier Guerrier <olivier@guerrier.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* In-process simulator: one sender and thousands of virtual receivers
+ * exchanging datagrams through a lossy, rate limited transport running
+ * on a virtual clock. Receivers go through the receive path of looprecv,
+ * network_recv then buffer_recv, into their own bitmap; the payloads all
+ * land in one scratch slab, thousands of images would not fit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "loopcast.h"
+
+// keepalives are fired and checked once per tick of virtual time
+#define SIMTICK 0.001
+
+// one virtual receiver and its link to the sender
+typedef struct node_s {
+	network_t network;
+	buffer_t buffer;
+	double done;
+	double keepalive;
+	uint64_t seed;
+	double rate;
+	double backlog;
+	double last;
+} node_t;
+
+typedef struct sim_s {
+	double now;
+	double tick;
+	double loss;
+	double frametime;
+	uint32_t queue;
+	uint32_t nchunks;
+	int maxwait;
+	int nnodes;
+	node_t *nodes;
+	options_t *options;
+	/* the frame being delivered, read by the receivers' transport */
+	message_t *inflight;
+	int inflightlen;
+	uint8_t *scratch;
+	uint32_t *kqueue;
+	int klen, kmax;
+	long frames, keepalives, completed;
+} sim_t;
+
+sim_t sim;
+
+// xorshift64*, one state per link so results do not depend on ordering
+double sim_random(uint64_t * state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+uint64_t sim_seed(uint64_t seed, int i)
+{
+	uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ULL;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return z ? z : 1;
+}
+
+/* returns the delivery delay of a frame on the link, or -1 if the frame is
+ * lost or does not fit in the link queue */
+double sim_link(node_t * node, int len)
+{
+	if (sim_random(&node->seed) < sim.loss) {
+		return -1;
+	}
+	if (!node->rate) {
+		return 0;
+	}
+	node->backlog -= (sim.now - node->last) * node->rate;
+	node->last = sim.now;
+	if (node->backlog < 0) {
+		node->backlog = 0;
+	}
+	if (node->backlog + len > (double)sim.queue * sizeof(message_t)) {
+		return -1;
+	}
+	node->backlog += len;
+	return node->backlog / node->rate;
+}
+
+void sim_deliver(message_t * message, int len)
+{
+	message_t frame;
+	double delay;
+	node_t *node;
+	int i;
+
+	sim.inflight = message;
+	sim.inflightlen = len;
+	for (i = 0; i < sim.nnodes; i++) {
+		node = &sim.nodes[i];
+		if (node->done) {
+			continue;
+		}
+		delay = sim_link(node, len);
+		if (delay < 0
+		    || !network_recv(sim.options, &node->network, &frame)
+		    || buffer_recv(sim.options, &node->buffer, &frame) != 1) {
+			continue;
+		}
+		if (node->buffer.received == node->buffer.nchunks) {
+			node->done = sim.now + delay;
+			sim.completed++;
+		}
+	}
+	sim.inflight = NULL;
+}
+
+int sim_init(options_t * options, network_t * network)
+{
+	return 1;
+}
+
+int sim_send(network_t * network, netsock_t * sock, void *data, int len)
+{
+	node_t *node = network->transport_data;
+
+	if (!node) {
+		sim.frames++;
+		sim_deliver(data, len);
+		return len;
+	}
+	/* keepalive from a virtual receiver, it shares the link loss */
+	if (sim_random(&node->seed) < sim.loss) {
+		return len;
+	}
+	if (sim.klen == sim.kmax) {
+		sim.kmax = sim.kmax ? sim.kmax * 2 : 1024;
+		sim.kqueue = realloc(sim.kqueue, sim.kmax * sizeof(uint32_t));
+		if (!sim.kqueue) {
+			ERROR(("sim_send: Not enough memory"));
+		}
+	}
+	sim.kqueue[sim.klen++] = *(uint32_t *) data;
+	return len;
+}
+
+int sim_recv(network_t * network, netsock_t * sock, void *data, int len)
+{
+	if (network->transport_data) {
+		if (sock != &network->data || !sim.inflight) {
+			return -1;
+		}
+		if (len > sim.inflightlen) {
+			len = sim.inflightlen;
+		}
+		memcpy(data, sim.inflight, len);
+		return len;
+	}
+	if (sock != &network->keepalive || !sim.klen) {
+		return -1;
+	}
+	*(uint32_t *) data = sim.kqueue[--sim.klen];
+	sim.keepalives++;
+	return sizeof(uint32_t);
+}
+
+time_t sim_time(network_t * network)
+{
+	return (time_t)sim.now;
+}
+
+int sim_clean(network_t * network)
+{
+	return 1;
+}
+
+transport_t sim_transport = {
+	.init = sim_init,
+	.send = sim_send,
+	.recv = sim_recv,
+	.time = sim_time,
+	.clean = sim_clean,
+};
+
+/* advance the virtual clock by one frame. On each tick, fire receivers'
+ * keepalives and let the sender read them, returns 0 when it must stop */
+int sim_tick(options_t * options, network_t * network, time_t starttime)
+{
+	node_t *node;
+	int i;
+
+	sim.now += sim.frametime;
+	if (!sim.maxwait || sim.now < sim.tick) {
+		return 1;
+	}
+	sim.tick = sim.now + SIMTICK;
+	for (i = 0; i < sim.nnodes; i++) {
+		node = &sim.nodes[i];
+		if (!node->done && node->keepalive <= sim.now) {
+			node->network.completion =
+			    (uint64_t)node->buffer.received * 100 /
+			    node->buffer.nchunks;
+			network_send_keepalive(&node->network);
+			node->keepalive += sim.maxwait;
+		}
+	}
+	return network_recv_keepalives(options, network, starttime);
+}
+
+int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+void sim_usage(char *me)
+{
+	do_printf("Usage:\n\t%s [options]\n", me);
+	do_printf("\t  -h : this help screen\n");
+	do_printf("\t  -c <clients> : number of virtual receivers (default 1000)\n");
+	do_printf("\t  -n <chunk numbers> : image size in %dKB chunks (default 1024)\n",
+		  CHUNKSIZE / 1024);
+	do_printf("\t  -w <rate> in KiB/s : sender rate (default 125000)\n");
+	do_printf("\t  -l <loss> : per-link loss rate in %% (default 0)\n");
+	do_printf
+	    ("\t  -b <rate>[:<percent>] in KiB/s : link capacity, applied to <percent>%% of\n"
+	     "\t\tthe links (default unlimited, 100%%)\n");
+	do_printf("\t  -q <frames> : link queue length (default 64)\n");
+	do_printf
+	    ("\t  -k : receivers send keepalives, the sender stops when they stop\n");
+	do_printf("\t  -m <maxwait> : keepalive period (default %ds)\n", MAXWAIT);
+	do_printf("\t  -s <seed> : random seed (default 1)\n");
+	do_printf("\t  -t <seconds> : maximum virtual duration (default 600)\n");
+	do_printf("\t  -v : be verbose\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char *noargs[] = { argv[0], NULL };
+	options_t options, roptions;
+	network_t network;
+	buffer_t buffer;
+	message_t message;
+	FILE *image;
+	node_t *node;
+	double *ttc, limit = 600, linkrate = 0, linkpercent = 100, wrate;
+	struct timeval start, stop;
+	uint64_t seed = 1;
+	uint32_t i;
+	uint32_t loop = 0;
+	time_t starttime;
+	int optc, k, n, verbose = 0, keepalives = 0;
+	char *colon;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.nnodes = 1000;
+	sim.nchunks = 1024;
+	sim.queue = 64;
+	wrate = 125000;
+	while ((optc = getopt(argc, argv, "b:c:hkl:m:n:q:s:t:vw:")) != EOF) {
+		switch (optc) {
+		case 'b':
+			linkrate = atof(optarg);
+			colon = strchr(optarg, ':');
+			if (colon) {
+				linkpercent = atof(colon + 1);
+			}
+			break;
+		case 'c':
+			sim.nnodes = atoi(optarg);
+			break;
+		case 'k':
+			keepalives = 1;
+			if (!sim.maxwait) {
+				sim.maxwait = MAXWAIT;
+			}
+			break;
+		case 'l':
+			sim.loss = atof(optarg) / 100;
+			break;
+		case 'm':
+			sim.maxwait = atoi(optarg);
+			break;
+		case 'n':
+			sim.nchunks = atoi(optarg);
+			break;
+		case 'q':
+			sim.queue = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			limit = atof(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			wrate = atof(optarg);
+			break;
+		default:
+			sim_usage(argv[0]);
+		}
+	}
+	if (sim.nnodes < 1 || sim.nchunks < 1 || sim.nchunks > 65535
+	    || wrate <= 0 || sim.queue < 1) {
+		sim_usage(argv[0]);
+	}
+	if (!keepalives) {
+		sim.maxwait = 0;
+	}
+	sim.frametime = sizeof(message_t) / (wrate * 1024);
+
+	optind = 1;
+	options_init(&options, SENDER, 1, noargs);
+	options.maxchunks = sim.nchunks;
+	options.transport = &sim_transport;
+	if (keepalives) {
+		options.keepalives = 1;
+		options.maxwait = sim.maxwait + 1;
+	}
+	roptions = options;
+	roptions.sender = RECEIVER;
+	sim.options = &roptions;
+
+	image = tmpfile();
+	if (!image) {
+		ERROR(("loopsim: Unable to create image file\n"));
+	}
+	for (i = 0; i < sim.nchunks * (CHUNKSIZE / sizeof(uint32_t)); i++) {
+		k = (int)sim_seed(seed, i);
+		fwrite(&k, sizeof(k), 1, image);
+	}
+	rewind(image);
+	buffer_init(&options, &buffer, image);
+	fclose(image);
+	network_init(&options, &network);
+	buffer_send(&buffer, 0, &message);
+
+	sim.nodes = calloc(sim.nnodes, sizeof(node_t));
+	ttc = calloc(sim.nnodes, sizeof(double));
+	sim.scratch = malloc(SLABCHUNKS * CHUNKSIZE);
+	if (!sim.nodes || !ttc || !sim.scratch) {
+		ERROR(("loopsim: Not enough memory\n"));
+	}
+	for (k = 0; k < sim.nnodes; k++) {
+		node = &sim.nodes[k];
+		network_init(&roptions, &node->network);
+		node->network.transport_data = node;
+		node->network.id = htonl(k % 65536);
+		/* sized by the first frame, as buffer_recv would, but all
+		 * slabs are the scratch one */
+		buffer_init(&roptions, &node->buffer, NULL);
+		buffer_alloc(&roptions, &node->buffer, &message);
+		for (i = 0; i < node->buffer.nslabs; i++) {
+			node->buffer.slabs[i] = sim.scratch;
+		}
+		node->seed = sim_seed(seed, k);
+		if (linkrate && sim_random(&node->seed) * 100 < linkpercent) {
+			node->rate = linkrate * 1024;
+		}
+		node->keepalive = sim_random(&node->seed);
+	}
+
+	gettimeofday(&start, NULL);
+	starttime = network_time(&network);
+	while (sim.completed < sim.nnodes && sim.now < limit) {
+		loop++;
+		for (i = 0; i < buffer.nchunks; i++) {
+			buffer_send(&buffer, i, &message);
+			network_send(&network, &message);
+			if (!sim_tick(&options, &network, starttime)) {
+				break;
+			}
+		}
+		if (verbose) {
+			do_printf("loop %u: %.3fs, %ld/%d receivers done\n",
+				  loop, sim.now, sim.completed, sim.nnodes);
+		}
+		if (options.keepalives
+		    && !network_recv_keepalives(&options, &network,
+						starttime)) {
+			if (verbose) {
+				do_printf("no keepalive received, stop sending\n");
+			}
+			break;
+		}
+	}
+	gettimeofday(&stop, NULL);
+
+	n = 0;
+	for (k = 0; k < sim.nnodes; k++) {
+		if (sim.nodes[k].done) {
+			ttc[n++] = sim.nodes[k].done;
+		}
+	}
+	qsort(ttc, n, sizeof(double), compare_double);
+	printf("clients=%d size=%lu loss=%g%% rate=%g link=%g:%g%% seed=%llu\n",
+	       sim.nnodes, (unsigned long)sim.nchunks * CHUNKSIZE,
+	       sim.loss * 100, wrate, linkrate, linkpercent,
+	       (unsigned long long)seed);
+	printf("completed=%d failed=%d\n", n, sim.nnodes - n);
+	if (n) {
+		double sum = 0;
+
+		for (k = 0; k < n; k++) {
+			sum += ttc[k];
+		}
+		printf
+		    ("ttc_min=%.3f ttc_p50=%.3f ttc_p90=%.3f ttc_p99=%.3f ttc_max=%.3f ttc_mean=%.3f\n",
+		     ttc[0], ttc[(int)((n - 1) * 0.5)], ttc[(int)((n - 1) * 0.9)],
+		     ttc[(int)((n - 1) * 0.99)], ttc[n - 1], sum / n);
+	}
+	printf("loops=%u frames=%ld wire_bytes=%lu wire_ratio=%.3f keepalives=%ld\n",
+	       loop, sim.frames, (unsigned long)(sim.frames * sizeof(message_t)),
+	       (double)sim.frames * sizeof(message_t) /
+	       ((double)sim.nchunks * CHUNKSIZE), sim.keepalives);
+	printf("sim_seconds=%.3f wall_seconds=%.3f\n", sim.now,
+	       (stop.tv_sec - start.tv_sec) +
+	       (stop.tv_usec - start.tv_usec) / 1000000.0);
+
+	network_clean(&network);
+	buffer_clean(&buffer);
+	return 0;
+}
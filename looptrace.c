@@ -0,0 +1,158 @@
+/*
+    loopcast is a small client/server utility to distribute data or simple
+    orders to a high number of clients through a multicast network socket.
+
+    Copyright (C) 2010  Olivier Guerrier <olivier@guerrier.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Decode a flight recorder dump (loopsend/looprecv -T, or SIGQUIT): all
+ * rings merged in time order, one event per line:
+ *   <seconds since start> <thread> <event> <arg>
+ * then per thread event counts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "loopcast.h"
+
+char *trace_names[] = {
+	[TRACE_RECV] = "recv",
+	[TRACE_DUP] = "dup",
+	[TRACE_CRCFAIL] = "crcfail",
+	[TRACE_CONTROL] = "control",
+	[TRACE_SEND] = "send",
+	[TRACE_PACE] = "pace",
+	[TRACE_KEEPALIVE_SEND] = "keepalive_send",
+	[TRACE_KEEPALIVE_RECV] = "keepalive_recv",
+	[TRACE_LOOP] = "loop",
+	[TRACE_DONE] = "done",
+	[TRACE_REPAIR] = "repair",
+};
+
+#define NTRACENAMES (sizeof(trace_names) / sizeof(trace_names[0]))
+
+typedef struct entry_s {
+	trace_event_t event;
+	int ring;
+} entry_t;
+
+int entry_cmp(const void *a, const void *b)
+{
+	const entry_t *ea = a, *eb = b;
+
+	if (ea->event.time != eb->event.time) {
+		return ea->event.time < eb->event.time ? -1 : 1;
+	}
+	return ea->ring - eb->ring;
+}
+
+void trace_usage(char *me)
+{
+	do_printf("Usage:\n\t%s [options] <trace file>\n", me);
+	do_printf("\t  -h : this help screen\n");
+	do_printf("\t  -c : only print the per thread event counts\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	tracefile_t header;
+	tracering_t *rings;
+	entry_t *entries;
+	long counts[MAXTRACERINGS][NTRACENAMES];
+	double scale = 1.0, t;
+	uint32_t first, i, n = 0;
+	int optc, r, countsonly = 0;
+	FILE *file;
+
+	while ((optc = getopt(argc, argv, "ch")) != EOF) {
+		switch (optc) {
+		case 'c':
+			countsonly = 1;
+			break;
+		default:
+			trace_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		trace_usage(argv[0]);
+	}
+	file = fopen(argv[optind], "r");
+	if (!file) {
+		ERROR(("looptrace: Unable to open '%s'\n", argv[optind]));
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+	    || header.nrings > MAXTRACERINGS) {
+		ERROR(("looptrace: '%s' is not a trace file\n", argv[optind]));
+	}
+	rings = malloc(header.nrings * sizeof(tracering_t));
+	entries = malloc(header.nrings * TRACESIZE * sizeof(entry_t));
+	if (!rings || !entries) {
+		ERROR(("looptrace: Not enough memory\n"));
+	}
+	if (fread(rings, sizeof(tracering_t), header.nrings, file) !=
+	    header.nrings) {
+		ERROR(("looptrace: '%s' is truncated\n", argv[optind]));
+	}
+	fclose(file);
+
+	/* tsc ticks to ns, from the two reference points of the dump */
+	if (header.tsc && header.clock1 > header.clock0) {
+		scale = (double)(header.ns1 - header.ns0) /
+		    (header.clock1 - header.clock0);
+	}
+	memset(counts, 0, sizeof(counts));
+	for (r = 0; r < header.nrings; r++) {
+		first = rings[r].head > TRACESIZE ? rings[r].head - TRACESIZE : 0;
+		for (i = first; i < rings[r].head; i++) {
+			entries[n].event = rings[r].events[i & (TRACESIZE - 1)];
+			entries[n].ring = r;
+			if (entries[n].event.type < NTRACENAMES) {
+				counts[r][entries[n].event.type]++;
+			}
+			n++;
+		}
+	}
+	qsort(entries, n, sizeof(entry_t), entry_cmp);
+
+	for (i = 0; i < n && !countsonly; i++) {
+		t = ((double)entries[i].event.time - header.clock0) * scale /
+		    1e9;
+		printf("%.9f %s %s %u\n", t, rings[entries[i].ring].name,
+		       entries[i].event.type < NTRACENAMES
+		       && trace_names[entries[i].event.type] ?
+		       trace_names[entries[i].event.type] : "unknown",
+		       entries[i].event.arg);
+	}
+	for (r = 0; r < header.nrings; r++) {
+		printf("# %s: %u events recorded, %u kept", rings[r].name,
+		       rings[r].head,
+		       rings[r].head > TRACESIZE ? TRACESIZE : rings[r].head);
+		for (i = 1; i < NTRACENAMES; i++) {
+			if (counts[r][i]) {
+				printf(" %s=%ld", trace_names[i], counts[r][i]);
+			}
+		}
+		printf("\n");
+	}
+	free(rings);
+	free(entries);
+	return 0;
+}
@@ -0,0 +1,130 @@
+#!/bin/sh
+#
+# Multi-receiver benchmark: one loopsend and CLIENTS looprecv instances, each
+# in its own network namespace, plugged on a bridge through veth pairs.
+# Loss, delay and rate limits are injected on every receiver link with netem.
+#
+# All settings are environment variables, e.g.:
+#   CLIENTS=100 SIZE_MB=64 LOSS=1% DELAY=2ms RATE=1gbit make bench
+#
+# Must be run as root (ip netns, tc).
+
+CLIENTS=${CLIENTS:-20}
+SIZE_MB=${SIZE_MB:-16}
+LOSS=${LOSS:-}
+DELAY=${DELAY:-}
+RATE=${RATE:-}
+SENDOPTS=${SENDOPTS:-}
+RECVOPTS=${RECVOPTS:-}
+TIMEOUT=${TIMEOUT:-300}
+NS=${NS:-lcb}
+
+# -n is at most 65535 chunks of 4KB, plus one for the tail
+if [ $SIZE_MB -ge 256 ]; then
+	echo "SIZE_MB must be less than 256"
+	exit 255
+fi
+
+BIN=$(pwd)
+DIR=$(mktemp -d /tmp/loopcast-bench.XXXXXX)
+
+if [ "$(id -u)" != "0" ]; then
+	echo "$0 must be run as root"
+	exit 255
+fi
+
+cleanup() {
+	for N in $(ip netns list | awk '{print $1}' | grep "^$NS-"); do
+		ip netns pids $N | xargs -r kill -KILL 2> /dev/null
+		ip netns del $N
+	done
+	rm -rf $DIR
+}
+trap cleanup EXIT INT TERM
+cleanup
+mkdir -p $DIR
+
+# nsup <namespace> <veth name in hub> <address>
+nsup() {
+	ip netns add $1
+	ip link add $2 netns $NS-hub type veth peer name eth0 netns $1
+	ip -n $NS-hub link set $2 master br0 up
+	ip -n $1 link set lo up
+	ip -n $1 link set eth0 up
+	ip -n $1 addr add $3/16 dev eth0
+	ip -n $1 route add 224.0.0.0/4 dev eth0
+}
+
+ip netns add $NS-hub
+ip -n $NS-hub link add br0 type bridge mcast_snooping 0
+ip -n $NS-hub link set br0 up
+
+nsup $NS-s s0 10.99.0.1
+NETEM=""
+[ "$LOSS" != "" ] && NETEM="$NETEM loss $LOSS"
+[ "$DELAY" != "" ] && NETEM="$NETEM delay $DELAY"
+[ "$RATE" != "" ] && NETEM="$NETEM rate $RATE"
+I=1
+while [ $I -le $CLIENTS ]; do
+	nsup $NS-r$I r$I 10.99.$((I / 250 + 1)).$((I % 250 + 2))
+	if [ "$NETEM" != "" ] &&
+	    ! tc -n $NS-hub qdisc add dev r$I root netem $NETEM; then
+		echo "unable to set up 'netem$NETEM' on receiver links"
+		exit 255
+	fi
+	I=$((I + 1))
+done
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > $DIR/image
+MD5=$(md5sum < $DIR/image)
+CHUNKS=$((SIZE_MB * 256 + 1))
+
+I=1
+while [ $I -le $CLIENTS ]; do
+	ip netns exec $NS-r$I sh -c "touch $DIR/r$I.start; \
+		timeout $TIMEOUT $BIN/looprecv -k -n $CHUNKS $RECVOPTS \
+		| md5sum > $DIR/r$I.md5; date +%s.%N > $DIR/r$I.end" &
+	echo $! >> $DIR/receivers
+	I=$((I + 1))
+done
+while [ $(ls $DIR/*.start 2> /dev/null | wc -l) -lt $CLIENTS ]; do
+	sleep 0.1
+done
+sleep 1
+
+date +%s.%N > $DIR/t0
+ip netns exec $NS-s sh -c "timeout $TIMEOUT $BIN/loopsend -k -n $CHUNKS \
+	$SENDOPTS < $DIR/image & echo \$! > $DIR/sender; wait; times > $DIR/times" &
+SENDER=$!
+for P in $(cat $DIR/receivers); do
+	wait $P
+done
+# the sender keeps looping until keepalives expire, only count bytes
+# and cpu time up to the last completion
+WIRE=$(ip netns exec $NS-s cat /sys/class/net/eth0/statistics/tx_bytes)
+kill $(cat $DIR/sender)
+wait $SENDER
+
+echo "clients=$CLIENTS size=$((SIZE_MB * 1048576)) loss=${LOSS:-0%} delay=${DELAY:-0ms} rate=${RATE:-none}"
+T0=$(cat $DIR/t0)
+I=1
+while [ $I -le $CLIENTS ]; do
+	if [ "$(cat $DIR/r$I.md5)" = "$MD5" ]; then
+		echo "$(cat $DIR/r$I.end) $T0" | awk '{printf "%.3f\n", $1 - $2}'
+	else
+		echo failed
+	fi
+	I=$((I + 1))
+done > $DIR/ttc
+echo "completed=$(grep -vc failed $DIR/ttc) failed=$(grep -c failed $DIR/ttc)"
+grep -v failed $DIR/ttc | sort -n | awk '
+	{ t[NR] = $1; sum += $1 }
+	END {
+		if (!NR) exit;
+		printf "ttc_min=%.3f ttc_p50=%.3f ttc_p90=%.3f ttc_p99=%.3f ttc_max=%.3f ttc_mean=%.3f\n",
+		    t[1], t[int((NR - 1) * 0.5) + 1], t[int((NR - 1) * 0.9) + 1],
+		    t[int((NR - 1) * 0.99) + 1], t[NR], sum / NR
+	}'
+tail -n 1 $DIR/times | sed -e 's/m/ /g' -e 's/s//g' | awk '
+	{ printf "sender_cpu_user=%.3f sender_cpu_sys=%.3f\n", $1 * 60 + $2, $3 * 60 + $4 }'
+echo "wire_bytes=$WIRE wire_ratio=$(echo $WIRE $SIZE_MB | awk '{printf "%.3f", $1 / ($2 * 1048576)}')"
@@ -0,0 +1,7 @@
+#!/bin/sh
+
+CAROUSEL=/tmp/loopcast.carousel
+
+./loopsend -C $CAROUSEL < test.rand.in
+./tests/00-skel-simple.sh "-k -V -F $CAROUSEL" "-k -V" "send a compiled carousel file, stdin is not read"
+rm -f $CAROUSEL
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+echo
+echo "a sender without -V, -z or -u sends no control frame, older receivers take its loops"
+echo
+
+CAPTURE=/tmp/looprecv.compat.capture
+./tests/00-skel-simple.sh "-k" "-k -W $CAPTURE" "capture to $CAPTURE"
+# a receiver from before the control frames exits on any chunk 0
+./loopreplay $CAPTURE | grep -q " control=0 " && echo "No control frame sent"
+rm -f $CAPTURE
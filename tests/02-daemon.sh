@@ -0,0 +1,18 @@
+#!/bin/sh
+
+echo
+echo "daemon: one sender serves two receivers started one after the other"
+echo
+
+killall looprecv 2> /dev/null
+rm -f test.rand.out
+cat test.rand.in | ./loopsend -D -v 2>&1 | grep -v "keepalive\|loop .* done" &
+sleep 2
+./looprecv -k > test.rand.out
+md5sum test.rand.* > test.md5
+sleep 2
+./looprecv -k > test.rand.out
+md5sum test.rand.out >> test.md5
+killall loopsend
+wait
+cat test.md5
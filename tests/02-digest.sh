@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./tests/00-skel-simple.sh "-k -V" "-v -k -V" "transfer the file, only written once it matches the sender's digest - verbose"
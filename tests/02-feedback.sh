@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./tests/00-skel-simple.sh "-v -k" "-f -m 2" "scalable feedback: randomized, sampled keepalives"
@@ -0,0 +1,19 @@
+#!/bin/sh
+
+echo
+echo "resumable receive: the receiver is killed halfway, restarted with its journal"
+echo
+
+killall looprecv 2> /dev/null
+rm -f test.rand.out test.journal
+./looprecv -i lo -k -v -j test.journal > test.rand.out &
+sleep 1
+cat test.rand.in | ./loopsend -i lo -k -V -w 20000 &
+sleep 3
+killall -KILL looprecv 2> /dev/null
+sleep 1
+./looprecv -i lo -k -v -V -j test.journal > test.rand.out
+wait
+[ -e test.journal ] && echo "journal left behind"
+md5sum test.rand.* > test.md5
+cat test.md5
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./tests/00-skel-simple.sh "-v -k -L 3 -w 20000" "-v -k -L 3" "layered multicast: three groups, the receiver joins them one by one"
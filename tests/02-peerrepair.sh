@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Peer repair: a sender and two receivers each in its own network namespace,
+# on a bridge. The second receiver joins in the middle of a loop and gets
+# the chunks it missed from the first one, before the next loop brings them.
+# Must be run as root (ip netns).
+
+echo
+echo "peer repair: a late receiver asks the other one for the chunks it missed"
+echo
+
+NS=lcp
+BIN=$(pwd)
+
+if [ "$(id -u)" != "0" ]; then
+	echo "$0 must be run as root"
+	exit 255
+fi
+
+cleanup() {
+	for N in $NS-s $NS-r1 $NS-r2 $NS-hub; do
+		ip netns pids $N 2> /dev/null | xargs -r kill -KILL 2> /dev/null
+		ip netns del $N 2> /dev/null
+	done
+}
+trap cleanup EXIT INT TERM
+cleanup
+
+# nsup <namespace> <veth name in hub> <address>
+nsup() {
+	ip netns add $1
+	ip link add $2 netns $NS-hub type veth peer name eth0 netns $1
+	ip -n $NS-hub link set $2 master br0 up
+	ip -n $1 link set lo up
+	ip -n $1 link set eth0 up
+	ip -n $1 addr add $3/24 dev eth0
+	ip -n $1 route add 224.0.0.0/4 dev eth0
+}
+
+ip netns add $NS-hub
+ip -n $NS-hub link add br0 type bridge mcast_snooping 0
+ip -n $NS-hub link set br0 up
+nsup $NS-s s0 10.97.0.1
+nsup $NS-r1 r1 10.97.0.2
+nsup $NS-r2 r2 10.97.0.3
+
+IN=/tmp/loopcast.peer.in
+head -c 16777216 test.rand.in > $IN
+rm -f test.rand.out test.peer.out test.peer.log test.late.log
+ip netns exec $NS-r1 $BIN/looprecv -k -A -v > test.peer.out 2> test.peer.log &
+sleep 1
+ip netns exec $NS-s $BIN/loopsend -k -w 5000 < $IN &
+# a loop takes about 3.3s, join in the middle of the first one
+sleep 1.6
+START=$(date +%s.%N)
+ip netns exec $NS-r2 $BIN/looprecv -k -A -v > test.rand.out 2> test.late.log
+echo "$(date +%s.%N) $START" |
+    awk '{ printf "late receiver done in %.1fs, a loop is about 3.3s\n", $1 - $2 }'
+wait
+grep -h "peer repair" test.peer.log test.late.log
+md5sum $IN test.peer.out test.rand.out
+rm -f $IN test.peer.out test.peer.log test.late.log
@@ -0,0 +1,19 @@
+#!/bin/sh
+
+echo
+echo "two cooperative senders, the second one is killed during the transfer"
+echo
+
+killall looprecv 2> /dev/null
+rm -f test.rand.out
+cat test.rand.in | ./loopsend -k -P 0/2 -w 20000 &
+cat test.rand.in | ./loopsend -k -P 1/2 -w 20000 -v &
+(
+	sleep 3
+	bash -c "time ./looprecv -k" 2> test.time > test.rand.out
+	md5sum test.rand.* > test.md5
+) &
+sleep 5
+pkill -f "loopsend -k -P 1/2"
+wait
+cat test.md5 test.time
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+echo
+echo "real-time transmit: gaps between arrivals, paced by the timer then busy-waiting"
+echo
+
+CAPTURE=/tmp/looprecv.capture
+./tests/00-skel-simple.sh "-k -w 20000" "-k -W $CAPTURE" "paced by the timer, capture to $CAPTURE"
+./loopreplay -g $CAPTURE
+./tests/00-skel-simple.sh "-k -w 20000 -b -a 0 -q 10" "-k -b 50 -W $CAPTURE" "busy-wait pacing, pinned and SCHED_FIFO, busy poll, capture to $CAPTURE"
+./loopreplay -g -v $CAPTURE
+rm -f $CAPTURE
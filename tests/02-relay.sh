@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Relay: a sender, a relay and a receiver each in its own network namespace,
+# the receiver only reachable through the relay's second interface.
+# Must be run as root (ip netns).
+
+echo
+echo "relay: the receiver's segment is only fed by a relay on the sender's one"
+echo
+
+NS=lcr
+BIN=$(pwd)
+
+if [ "$(id -u)" != "0" ]; then
+	echo "$0 must be run as root"
+	exit 255
+fi
+
+cleanup() {
+	for N in $NS-s $NS-r $NS-d; do
+		ip netns pids $N 2> /dev/null | xargs -r kill -KILL 2> /dev/null
+		ip netns del $N 2> /dev/null
+	done
+}
+trap cleanup EXIT INT TERM
+cleanup
+
+# sender eth0 <-> eth0 relay eth1 <-> eth0 receiver
+for N in $NS-s $NS-r $NS-d; do
+	ip netns add $N
+	ip -n $N link set lo up
+done
+ip link add eth0 netns $NS-s type veth peer name eth0 netns $NS-r
+ip link add eth1 netns $NS-r type veth peer name eth0 netns $NS-d
+ip -n $NS-s addr add 10.98.1.1/24 dev eth0
+ip -n $NS-r addr add 10.98.1.2/24 dev eth0
+ip -n $NS-r addr add 10.98.2.1/24 dev eth1
+ip -n $NS-d addr add 10.98.2.2/24 dev eth0
+for N in $NS-s $NS-r $NS-d; do
+	ip -n $N link set eth0 up
+	ip -n $N route add 224.0.0.0/4 dev eth0
+done
+ip -n $NS-r link set eth1 up
+
+rm -f test.rand.out test.relay.out
+ip netns exec $NS-r $BIN/looprecv -k -l eth1:50000 > test.relay.out &
+ip netns exec $NS-d $BIN/looprecv -k > test.rand.out &
+RECEIVER=$!
+sleep 1
+ip netns exec $NS-s $BIN/loopsend -k -w 50000 < test.rand.in &
+wait $RECEIVER
+echo "receiver done, the relay and the sender stop once keepalives expire"
+wait
+md5sum test.rand.in test.relay.out test.rand.out
+rm -f test.relay.out
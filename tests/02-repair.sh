@@ -0,0 +1,17 @@
+#!/bin/sh
+
+echo
+echo "unicast repair: the second client starts once the first one is done"
+echo
+
+killall looprecv 2> /dev/null
+rm -f test.rand.out
+cat test.rand.in | ./loopsend -u 50 -V -v -w 50000 2>&1 | grep -v keepalive &
+sleep 1
+./looprecv -k -N 1 > /dev/null
+echo "first client done, multicast loops should stop"
+sleep 1
+bash -c "time ./looprecv -k -N 2 -V" 2> test.time > test.rand.out
+md5sum test.rand.* > test.md5
+wait
+cat test.md5 test.time
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+echo
+echo "capture and replay: the datagrams received are fed again through the receive path"
+echo
+
+CAPTURE=/tmp/looprecv.capture
+./tests/00-skel-simple.sh "-k -V" "-k -W $CAPTURE" "capture to $CAPTURE"
+./loopreplay -r 3 $CAPTURE
+./loopreplay -p $CAPTURE
+rm -f $CAPTURE
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+IN=/tmp/loopcast.sparse.in
+OUT=/tmp/loopcast.sparse.out
+
+echo
+echo "elide zero chunks, the receiver writes them as holes"
+echo
+
+# random data, 64MB of zeroes, random data
+dd if=test.rand.in of=$IN bs=1M count=8 2> /dev/null
+dd if=/dev/zero of=$IN bs=1M count=64 seek=8 2> /dev/null
+dd if=test.rand.in of=$IN bs=1M count=8 seek=72 2> /dev/null
+
+rm -f $OUT
+(
+	sleep 3
+	./looprecv -k -V > $OUT
+) &
+./loopsend -k -V -z -v < $IN
+sleep 1
+cmp $IN $OUT && echo "Same content, $(du -k $OUT | cut -f 1)KB used instead of $(du -k $IN | cut -f 1)KB"
+rm -f $IN $OUT
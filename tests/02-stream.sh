@@ -0,0 +1,15 @@
+#!/bin/sh
+
+echo
+echo "streaming: the input comes in two parts a second apart, sent as read"
+echo
+
+killall looprecv 2> /dev/null
+rm -f test.rand.out
+./looprecv -k -V > test.rand.out &
+sleep 1
+(head -c 1000000 test.rand.in; sleep 1; tail -c +1000001 test.rand.in) \
+	| ./loopsend -S -k -V -v 2>&1 | grep -v keepalive
+wait
+md5sum test.rand.* > test.md5
+cat test.md5
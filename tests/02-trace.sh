@@ -0,0 +1,7 @@
+#!/bin/sh
+
+TRACE=/tmp/looprecv.trace
+
+./tests/00-skel-simple.sh -k "-k -T $TRACE" "transfer the file, and dump the receiver's flight recorder"
+./looptrace -c $TRACE
+rm -f $TRACE
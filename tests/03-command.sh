@@ -0,0 +1,20 @@
+#!/bin/sh
+
+echo
+echo "command mode: a signed return value only, the client starts late"
+echo
+
+head -c 64 test.rand.in > test.key
+(
+    sleep 2
+    ./looprecv -v -k -K test.key > /dev/null
+	RET=$?
+	if [ "$RET" != "42" ]; then
+		echo -n "FAIL: "
+	fi
+	echo "Exit is '$RET', expected '42'"
+) &
+./loopsend -v -c -r 42 -N 1 -K test.key
+echo "sender exit is '$?', expected '0'"
+wait
+rm -f test.key